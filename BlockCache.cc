@@ -0,0 +1,67 @@
+#include "BlockCache.hh"
+#include <QString>
+#include <QMutexLocker>
+
+CachedBlock::CachedBlock(qint64 idx, QByteArray data)
+{
+    this->idx = idx;
+    this->data = data;
+    this->prefetched = false;
+}
+
+BlockCache::BlockCache(int maxBytes) : blocks(maxBytes)
+{
+    hits = 0;
+    misses = 0;
+    prefetched = 0;
+    prefetchHits = 0;
+}
+
+bool BlockCache::lookup(QByteArray hash, qint64 &idx, QByteArray &data)
+{
+    QMutexLocker locker(&mutex);
+    CachedBlock *block = blocks.object(hash);
+    if (!block){
+        misses++;
+        return false;
+    }
+
+    hits++;
+    if (block->prefetched){
+        prefetchHits++;
+        block->prefetched = false;
+    }
+    idx = block->idx;
+    data = block->data;
+    return true;
+}
+
+// The cost of a block is its size, so the cache is bounded in bytes
+void BlockCache::insert(QByteArray hash, qint64 idx, QByteArray data, bool prefetched)
+{
+    QMutexLocker locker(&mutex);
+    if (prefetched){
+        if (blocks.contains(hash))
+            return;
+        this->prefetched++;
+    }
+
+    CachedBlock *block = new CachedBlock(idx, data);
+    block->prefetched = prefetched;
+    blocks.insert(hash, block, qMax(1, data.size()));
+}
+
+void BlockCache::clear()
+{
+    QMutexLocker locker(&mutex);
+    blocks.clear();
+}
+
+QString BlockCache::stats()
+{
+    QMutexLocker locker(&mutex);
+    quint64 lookups = hits + misses;
+    return QString("%1 hits, %2 misses (%3% hit rate), %4 read ahead, %5 of them used, %6 KB cached")
+        .arg(hits).arg(misses).arg(lookups ? 100 * hits / lookups : 0)
+        .arg(prefetched).arg(prefetchHits).arg(blocks.totalCost() / 1024);
+}
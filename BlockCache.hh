@@ -0,0 +1,47 @@
+#ifndef BLOCKCACHE_HH
+#define BLOCKCACHE_HH
+
+#include <QByteArray>
+#include <QString>
+#include <QCache>
+#include <QMutex>
+
+#define BLOCKCACHE_BYTES    (64 * 1024 * 1024)  // Data kept in memory
+#define READAHEAD_LEAVES    8                   // Siblings read after a leaf miss
+
+class CachedBlock
+{
+    public:
+        CachedBlock(qint64 idx, QByteArray data);
+
+        qint64 idx;
+        QByteArray data;
+        bool prefetched;    // Read ahead, not requested yet
+};
+
+// Recently served blocks, by hash. Popular blocks that several peers ask for
+// within a short time are read from storage once. Evicts the least recently
+// used blocks past BLOCKCACHE_BYTES. Safe to use from the storage readers.
+class BlockCache
+{
+    public:
+        BlockCache(int maxBytes = BLOCKCACHE_BYTES);
+
+        bool lookup(QByteArray hash, qint64 &idx, QByteArray &data);
+        void insert(QByteArray hash, qint64 idx, QByteArray data, bool prefetched = false);
+        void clear();
+
+        // Statistics
+        quint64 hits;
+        quint64 misses;
+        quint64 prefetched;     // Blocks read ahead
+        quint64 prefetchHits;   // Read ahead blocks that were then requested
+
+        QString stats();
+
+    private:
+        QCache<QByteArray, CachedBlock> blocks;
+        QMutex mutex;
+};
+
+#endif // BLOCKCACHE_HH
@@ -0,0 +1,108 @@
+#include "BlockQueue.hh"
+#include <string.h>
+
+InlineHash::InlineHash(const QByteArray &hash)
+{
+    size = qMin(hash.size(), MAX_DIGEST_SIZE);
+    memcpy(bytes, hash.constData(), size);
+}
+
+QByteArray InlineHash::toByteArray() const
+{
+    return QByteArray(bytes, size);
+}
+
+BlockQueue::BlockQueue(int fanOut)
+{
+    this->fanOut = qMax(1, fanOut);
+    quint64 step = 1 << 3;
+    for (int level = TREE_MAX_LEVEL; level >= 0; --level){
+        span[level] = step;
+        step *= qMax(1, fanOut);
+    }
+}
+
+bool BlockQueue::child(quint64 parent, int i, quint64 &position) const
+{
+    int childLevel = level(parent) + 1;
+    if (childLevel > TREE_MAX_LEVEL)
+        return false;
+    position = (parent & ~(quint64) 0x7) + i * span[childLevel] + childLevel;
+    return true;
+}
+
+quint64 BlockQueue::leafPosition(quint64 idx, int leafLevel) const
+{
+    leafLevel = qBound(0, leafLevel, TREE_MAX_LEVEL);
+    quint64 position = leafLevel;
+    for (int level = leafLevel; level > 0; --level){
+        position += (idx % fanOut) * span[level];
+        idx /= fanOut;
+    }
+    return position;
+}
+
+bool BlockQueue::covers(quint64 position, quint64 target) const
+{
+    quint64 first = position & ~(quint64) 0x7;
+    return target >= first && target < first + span[level(position)];
+}
+
+void BlockQueue::insert(quint64 position, const QByteArray &hash)
+{
+    nodes.insert(position, InlineHash(hash));
+}
+
+void BlockQueue::save(QDataStream &out) const
+{
+    out << (quint32) nodes.size();
+    QMap<quint64, InlineHash>::const_iterator it;
+    for (it = nodes.constBegin(); it != nodes.constEnd(); ++it)
+        out << it.key() << it->toByteArray();
+}
+
+// Adds the saved nodes to the queue
+bool BlockQueue::load(QDataStream &in)
+{
+    quint32 count;
+    in >> count;
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i){
+        quint64 position;
+        QByteArray hash;
+        in >> position >> hash;
+        if (in.status() == QDataStream::Ok)
+            insert(position, hash);
+    }
+    return in.status() == QDataStream::Ok;
+}
+
+bool BlockQueue::takeNth(int n, quint64 &position, QByteArray &hash)
+{
+    if (nodes.size() <= n)
+        return false;
+
+    QMap<quint64, InlineHash>::iterator it = nodes.begin();
+    it += n;
+    position = it.key();
+    hash = it->toByteArray();
+    nodes.erase(it);
+    return true;
+}
+
+bool BlockQueue::takeFrom(quint64 target, quint64 &position, QByteArray &hash)
+{
+    QMap<quint64, InlineHash>::iterator it = nodes.upperBound(target);
+    if (it != nodes.begin()){
+        // An ancestor of target sorts before it
+        QMap<quint64, InlineHash>::iterator prev = it - 1;
+        if (covers(prev.key(), target))
+            it = prev;
+    }
+    if (it == nodes.end())
+        return false;
+
+    position = it.key();
+    hash = it->toByteArray();
+    nodes.erase(it);
+    return true;
+}
@@ -0,0 +1,66 @@
+#ifndef BLOCKQUEUE_HH
+#define BLOCKQUEUE_HH
+
+#include <QByteArray>
+#include <QMap>
+#include <QDataStream>
+#include "hashsum.hh"
+
+#define TREE_MAX_LEVEL  7   // Levels below the head a BlockQueue can place
+
+// A block hash kept by value, without a QByteArray allocation per entry
+class InlineHash
+{
+    public:
+        InlineHash(const QByteArray &hash = QByteArray());
+        QByteArray toByteArray() const;
+
+    private:
+        quint8 size;
+        char bytes[MAX_DIGEST_SIZE];
+};
+
+// Tree nodes waiting to be requested, in pre-order: a metadata block comes
+// before its children, and leaves come in file order. A node's position is
+// a 64 bit key: its path from the head as base fanOut digits, left aligned
+// to TREE_MAX_LEVEL digits, then its level in the low 3 bits. So comparing
+// keys is comparing places in the pre-order, and a request that times out
+// goes back in at the same place. With fanOut <= 410 (20 byte hashes in an
+// 8 KiB block), the largest key is 410^7 * 8, about 1.56e19, just under
+// 2^64 (1.84e19). An eighth level would not fit, hence TREE_MAX_LEVEL.
+class BlockQueue
+{
+    public:
+        BlockQueue(int fanOut = 1);
+
+        static quint64 head() { return 0; }
+        static int level(quint64 position) { return position & 0x7; }
+        // Position of the i-th child of parent, false past TREE_MAX_LEVEL
+        bool child(quint64 parent, int i, quint64 &position) const;
+        // Position of leaf idx in a tree whose leaves are leafLevel deep
+        quint64 leafPosition(quint64 idx, int leafLevel) const;
+        // Whether target is in the subtree under position
+        bool covers(quint64 position, quint64 target) const;
+
+        void insert(quint64 position, const QByteArray &hash);
+        // Removes the n-th node in pre-order, false if there are fewer.
+        // O(log size + n), and n is small: 0 or TIMEOUT_NEXT.
+        bool takeNth(int n, quint64 &position, QByteArray &hash);
+        // Removes the first node from target on in pre-order: the one whose
+        // subtree holds target, else the next one. False if there is none.
+        bool takeFrom(quint64 target, quint64 &position, QByteArray &hash);
+
+        int size() const { return nodes.size(); }
+        bool isEmpty() const { return nodes.isEmpty(); }
+
+        // Checkpoints, as (position, hash) pairs
+        void save(QDataStream &out) const;
+        bool load(QDataStream &in);
+
+    private:
+        int fanOut;
+        quint64 span[TREE_MAX_LEVEL + 1];   // Key step between siblings, by level
+        QMap<quint64, InlineHash> nodes;
+};
+
+#endif // BLOCKQUEUE_HH
@@ -1,14 +1,15 @@
 #include "main.hh"
 
-BlockRequest::BlockRequest(FileDownload* parent, QByteArray hash, QString source, QString priority, quint16 maxClock)
+BlockRequest::BlockRequest(FileDownload* parent, QByteArray hash, QString source, quint64 position, int timeout)
 {
     this->parent = parent;
     this->hash = hash;
     this->source = source;
-    this->priority = priority;
-    this->clock = 0;
-    this->maxClock = maxClock;
-    timer.setInterval(BLOCKTIMEOUT);
+    this->position = position;
+    this->seq = 0;
+    this->retry = false;
+    timer.setSingleShot(true);
+    timer.setInterval(timeout);
 
     connect(&timer, SIGNAL(timeout()), this, SLOT(sendTimeout()));
 }
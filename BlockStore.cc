@@ -0,0 +1,488 @@
+#include "BlockStore.hh"
+#include "hashsum.hh"
+#include <QDir>
+#include <QFile>
+#include <QDebug>
+#include <QtEndian>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <string.h>
+
+// Index entries, all integers big endian:
+//
+//  0       hash length
+//  1       flags (IDX_REF)
+//  2-3     reserved
+//  4-35    hash, zero padded
+//  36-43   offset in pack, or in the source file for IDX_REF
+//  44-47   length
+//  48-55   block index in file, -1 for metadata
+//  56-63   reserved
+
+BlockLocation::BlockLocation(quint32 pack, quint64 offset, quint32 length, qint64 idx, quint8 flags)
+{
+    this->pack = pack;
+    this->offset = offset;
+    this->length = length;
+    this->idx = idx;
+    this->flags = flags;
+}
+
+PackFile::PackFile(quint32 id)
+{
+    this->id = id;
+    this->dataFd = -1;
+    this->idxFd = -1;
+    this->size = 0;
+    this->sourceSize = 0;
+    this->sourceMtime = 0;
+    this->sourceFd = -1;
+    this->stale = false;
+    this->lastCheck = 0;
+}
+
+BlockStore::BlockStore()
+{
+    nextId = 0;
+    clock.start();
+}
+
+BlockStore::~BlockStore()
+{
+    close();
+}
+
+bool BlockStore::open(QString dirPath, bool *created)
+{
+    QWriteLocker locker(&lock);
+    QDir dir(dirPath);
+    this->dirPath = dir.absolutePath();
+
+    if (created)
+        *created = !dir.exists();
+    if (!dir.exists() && !QDir().mkpath(this->dirPath)){
+        qDebug() << "Can't create block store" << this->dirPath;
+        return false;
+    }
+
+    QStringList idxFiles = dir.entryList(QStringList() << "*.idx", QDir::Files);
+    for (int i = 0; i < idxFiles.size(); ++i){
+        bool ok;
+        quint32 id = idxFiles.at(i).section('.', 0, 0).toUInt(&ok);
+        if (!ok)
+            continue;
+        if (id != PACK_LEGACY)
+            nextId = qMax(nextId, id + 1);
+        if (!loadPack(id))
+            qDebug() << "Skipping damaged pack" << idxFiles.at(i);
+    }
+    qDebug() << "Block store has" << index.size() << "blocks in" << packs.size() << "packs";
+    return true;
+}
+
+void BlockStore::close()
+{
+    QWriteLocker locker(&lock);
+    QHash<quint32, PackFile*>::iterator it;
+    for (it = packs.begin(); it != packs.end(); ++it){
+        flushPack(*it);
+        ::close((*it)->dataFd);
+        ::close((*it)->idxFd);
+        if ((*it)->sourceFd >= 0)
+            ::close((*it)->sourceFd);
+        delete *it;
+    }
+    packs.clear();
+    index.clear();
+}
+
+QString BlockStore::packPath(quint32 id, QString suffix)
+{
+    return dirPath + "/" + QString::number(id) + suffix;
+}
+
+PackFile* BlockStore::openPack(quint32 id, bool create)
+{
+    PackFile *pack = packs.value(id);
+    if (pack)
+        return pack;
+
+    int flags = O_RDWR | O_APPEND | (create ? O_CREAT : 0);
+    QByteArray dataPath = QFile::encodeName(packPath(id, ".pack"));
+    QByteArray idxPath = QFile::encodeName(packPath(id, ".idx"));
+
+    pack = new PackFile(id);
+    pack->dataFd = ::open(dataPath.constData(), flags, 0644);
+    pack->idxFd = ::open(idxPath.constData(), flags, 0644);
+    if (pack->dataFd < 0 || pack->idxFd < 0){
+        qDebug() << "Can't open pack" << id << strerror(errno);
+        if (pack->dataFd >= 0) ::close(pack->dataFd);
+        if (pack->idxFd >= 0) ::close(pack->idxFd);
+        delete pack;
+        return NULL;
+    }
+
+    pack->size = lseek(pack->dataFd, 0, SEEK_END);
+    packs.insert(id, pack);
+    return pack;
+}
+
+// Reads a pack's index into memory. Entries pointing past the end of the
+// pack (from a crash between the data and the index write) are dropped.
+bool BlockStore::loadPack(quint32 id)
+{
+    PackFile *pack = openPack(id, false);
+    if (!pack)
+        return false;
+
+    QFile idxFile(packPath(id, ".idx"));
+    if (!idxFile.open(QIODevice::ReadOnly))
+        return false;
+    QByteArray entries = idxFile.readAll();
+
+    for (int pos = 0; pos + IDX_ENTRY_SIZE <= entries.size(); pos += IDX_ENTRY_SIZE){
+        const uchar *entry = (const uchar*) entries.constData() + pos;
+        int hashSize = qMin((int) entry[0], MAX_DIGEST_SIZE);
+        BlockLocation location(id, qFromBigEndian<quint64>(entry + 36),
+                               qFromBigEndian<quint32>(entry + 44),
+                               (qint64) qFromBigEndian<quint64>(entry + 48), entry[1]);
+        if (!(location.flags & IDX_REF) && location.offset + location.length > pack->size)
+            continue;
+        QByteArray hash((const char*) entry + 4, hashSize);
+        index.insert(hash, location);
+        addLeaf(pack, hash, location.idx);
+    }
+    return true;
+}
+
+// Finds a copy of hash already stored in the given pack
+bool BlockStore::findInPack(QByteArray hash, quint32 pack, BlockLocation &location)
+{
+    QMultiHash<QByteArray, BlockLocation>::const_iterator it = index.constFind(hash);
+    for (; it != index.constEnd() && it.key() == hash; ++it){
+        if (it->pack == pack){
+            location = *it;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Appends a block to its file's pack. A block already in the pack (a
+// repeated block in the same file) only gets a new index entry.
+bool BlockStore::insert(quint32 packId, QByteArray hash, QByteArray data, qint64 idx)
+{
+    QWriteLocker locker(&lock);
+    if (hash.size() > MAX_DIGEST_SIZE)
+        return false;
+
+    PackFile *pack = openPack(packId, true);
+    if (!pack)
+        return false;
+
+    BlockLocation location(packId, pack->size, data.size(), idx);
+    BlockLocation existing;
+    if (findInPack(hash, packId, existing) && !(existing.flags & IDX_REF)){
+        location.offset = existing.offset;
+    }
+    else{
+        qint64 written = ::write(pack->dataFd, data.constData(), data.size());
+        if (written != data.size()){
+            qDebug() << "Pack write failed" << packId << strerror(errno);
+            // Keep size in step with the file, a partial block is just dead space
+            if (written > 0)
+                pack->size += written;
+            return false;
+        }
+        pack->size += data.size();
+    }
+
+    return appendEntry(pack, hash, location);
+}
+
+// Records a leaf block of a file shared in place: offset and length locate
+// it in the source file, nothing is copied
+bool BlockStore::insertRef(quint32 packId, QByteArray hash, qint64 idx, quint64 offset, quint32 length)
+{
+    QWriteLocker locker(&lock);
+    if (hash.size() > MAX_DIGEST_SIZE)
+        return false;
+
+    PackFile *pack = openPack(packId, true);
+    if (!pack)
+        return false;
+
+    return appendEntry(pack, hash, BlockLocation(packId, offset, length, idx, IDX_REF));
+}
+
+bool BlockStore::appendEntry(PackFile *pack, QByteArray hash, const BlockLocation &location)
+{
+    uchar entry[IDX_ENTRY_SIZE];
+    memset(entry, 0, sizeof(entry));
+    entry[0] = hash.size();
+    entry[1] = location.flags;
+    memcpy(entry + 4, hash.constData(), hash.size());
+    qToBigEndian<quint64>(location.offset, entry + 36);
+    qToBigEndian<quint32>(location.length, entry + 44);
+    qToBigEndian<quint64>((quint64) location.idx, entry + 48);
+    pack->pendingIdx.append((const char*) entry, IDX_ENTRY_SIZE);
+
+    index.insert(hash, location);
+    addLeaf(pack, hash, location.idx);
+
+    if (pack->pendingIdx.size() >= IDX_FLUSH * IDX_ENTRY_SIZE)
+        return flushPack(pack);
+    return true;
+}
+
+// Sets the source file of a pack, with the size and mtime it had when it
+// was shared
+bool BlockStore::setSource(quint32 packId, QString path, quint64 size, qint64 mtime)
+{
+    QWriteLocker locker(&lock);
+    PackFile *pack = openPack(packId, true);
+    if (!pack)
+        return false;
+
+    if (pack->sourceFd >= 0)
+        ::close(pack->sourceFd);
+    pack->sourcePath = path;
+    pack->sourceSize = size;
+    pack->sourceMtime = mtime;
+    pack->sourceFd = -1;
+    pack->stale = false;
+    pack->lastCheck = 0;
+    return true;
+}
+
+// Makes sure a pack's source is still the file that was shared: same size
+// and mtime, or just size while it is still being downloaded (its mtime
+// is SOURCE_GROWING). Checked at most every SOURCE_CHECK msec; once the
+// source has changed, the pack's leaves are never served again. Readers may
+// be using the source descriptor, so it stays open until the pack is dropped.
+bool BlockStore::checkSource(PackFile *pack)
+{
+    QMutexLocker locker(&sourceLock);
+    if (pack->stale || pack->sourcePath.isEmpty())
+        return false;
+    if (pack->sourceFd >= 0 && clock.elapsed() - pack->lastCheck < SOURCE_CHECK)
+        return true;
+
+    struct stat info;
+    QByteArray path = QFile::encodeName(pack->sourcePath);
+    if (::stat(path.constData(), &info) != 0 || (quint64) info.st_size != pack->sourceSize
+        || (pack->sourceMtime != SOURCE_GROWING && (qint64) info.st_mtime != pack->sourceMtime)){
+        qDebug() << "Shared file" << pack->sourcePath << "changed or is gone, not serving it";
+        pack->stale = true;
+        return false;
+    }
+
+    if (pack->sourceFd < 0){
+        pack->sourceFd = ::open(path.constData(), O_RDONLY);
+        if (pack->sourceFd < 0){
+            qDebug() << "Can't open shared file" << pack->sourcePath << strerror(errno);
+            return false;
+        }
+    }
+    pack->lastCheck = clock.elapsed();
+    return true;
+}
+
+// Remembers which hash is leaf idx of a pack. The legacy pack mixes blocks of
+// many files under the same indexes, so it gets no read-ahead.
+void BlockStore::addLeaf(PackFile *pack, const QByteArray &hash, qint64 idx)
+{
+    if (idx < 0 || pack->id == PACK_LEGACY)
+        return;
+    if (idx >= pack->leaves.size())
+        pack->leaves.resize(qMax((int) idx + 1, 2 * pack->leaves.size()));
+    pack->leaves[idx] = hash;
+}
+
+bool BlockStore::findLeaf(PackFile *pack, qint64 idx, BlockLocation &location)
+{
+    if (idx >= pack->leaves.size() || pack->leaves.at(idx).isEmpty())
+        return false;
+
+    QByteArray hash = pack->leaves.at(idx);
+    QMultiHash<QByteArray, BlockLocation>::const_iterator it = index.constFind(hash);
+    for (; it != index.constEnd() && it.key() == hash; ++it){
+        if (it->pack == pack->id && it->idx == idx){
+            location = *it;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The file descriptor a block is read from, -1 if it can't be read
+int BlockStore::readFrom(PackFile *pack, const BlockLocation &location)
+{
+    if (!(location.flags & IDX_REF))
+        return pack->dataFd;
+    if (!checkSource(pack))
+        return -1;
+    return pack->sourceFd;
+}
+
+// Reads a block. If the same hash is in several packs, the first readable
+// copy wins, so a stale source doesn't hide a good copy elsewhere.
+bool BlockStore::get(QByteArray hash, BlockLocation &location, QByteArray &data)
+{
+    QReadLocker locker(&lock);
+    QMultiHash<QByteArray, BlockLocation>::const_iterator it = index.constFind(hash);
+    for (; it != index.constEnd() && it.key() == hash; ++it){
+        PackFile *pack = packs.value(it->pack);
+        if (!pack)
+            continue;
+
+        int fd = readFrom(pack, *it);
+        if (fd < 0)
+            continue;
+
+        data = QByteArray(it->length, Qt::Uninitialized);
+        qint64 got = ::pread(fd, data.data(), it->length, it->offset);
+        if (got == it->length){
+            location = *it;
+            return true;
+        }
+        qDebug() << "Block read failed, pack" << it->pack << "offset" << it->offset;
+    }
+    data.clear();
+    return false;
+}
+
+// Where get() would read the block from, without reading it
+bool BlockStore::locate(QByteArray hash, BlockLocation &location)
+{
+    QReadLocker locker(&lock);
+    QMultiHash<QByteArray, BlockLocation>::const_iterator it = index.constFind(hash);
+    for (; it != index.constEnd() && it.key() == hash; ++it){
+        if (packs.contains(it->pack)){
+            location = *it;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads up to count leaves following the one at location, in the same file.
+// Leaves lie back to back in the pack (or source file), so the run is read
+// with one pread() and split; a gap ends the run. Returns how many were read.
+int BlockStore::readAhead(const BlockLocation &location, int count, QList<QByteArray> &hashes,
+                          QList<QByteArray> &blocks, QList<qint64> &idxs)
+{
+    QReadLocker locker(&lock);
+    PackFile *pack = packs.value(location.pack);
+    if (!pack || location.idx < 0)
+        return 0;
+
+    QList<BlockLocation> run;
+    BlockLocation prev = location;
+    for (int k = 1; k <= count; ++k){
+        BlockLocation next;
+        if (!findLeaf(pack, location.idx + k, next) || next.flags != location.flags
+            || next.offset != prev.offset + prev.length)
+            break;
+        run << next;
+        prev = next;
+    }
+    if (run.isEmpty())
+        return 0;
+
+    int fd = readFrom(pack, location);
+    if (fd < 0)
+        return 0;
+
+    quint64 start = run.first().offset;
+    quint64 span = run.last().offset + run.last().length - start;
+    QByteArray raw(span, Qt::Uninitialized);
+    qint64 got = ::pread(fd, raw.data(), span, start);
+    if (got != (qint64) span)
+        return 0;
+
+    for (int k = 0; k < run.size(); ++k){
+        hashes << pack->leaves.at(run.at(k).idx);
+        blocks << raw.mid(run.at(k).offset - start, run.at(k).length);
+        idxs << run.at(k).idx;
+    }
+    return run.size();
+}
+
+bool BlockStore::flushPack(PackFile *pack)
+{
+    if (pack->pendingIdx.isEmpty())
+        return true;
+
+    qint64 written = ::write(pack->idxFd, pack->pendingIdx.constData(), pack->pendingIdx.size());
+    if (written != pack->pendingIdx.size()){
+        qDebug() << "Pack index write failed" << pack->id << strerror(errno);
+        return false;
+    }
+    pack->pendingIdx.clear();
+    return true;
+}
+
+bool BlockStore::flush()
+{
+    QWriteLocker locker(&lock);
+    bool ok = true;
+    QHash<quint32, PackFile*>::iterator it;
+    for (it = packs.begin(); it != packs.end(); ++it)
+        ok = flushPack(*it) && ok;
+    return ok;
+}
+
+// Drops a file's pack: its index entries, then both files on disk. The
+// pack's own index says which hashes to look up, so the rest of the store
+// is not scanned.
+bool BlockStore::remove(quint32 packId)
+{
+    QWriteLocker locker(&lock);
+    PackFile *pack = packs.take(packId);
+    if (!pack)
+        return false;
+
+    flushPack(pack);
+    QFile idxFile(packPath(packId, ".idx"));
+    QByteArray entries;
+    if (idxFile.open(QIODevice::ReadOnly))
+        entries = idxFile.readAll();
+
+    for (int pos = 0; pos + IDX_ENTRY_SIZE <= entries.size(); pos += IDX_ENTRY_SIZE){
+        const char *entry = entries.constData() + pos;
+        QByteArray hash(entry + 4, qMin((int) (uchar) entry[0], MAX_DIGEST_SIZE));
+        QMultiHash<QByteArray, BlockLocation>::iterator it = index.find(hash);
+        while (it != index.end() && it.key() == hash){
+            if (it->pack == packId)
+                it = index.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    ::close(pack->dataFd);
+    ::close(pack->idxFd);
+    if (pack->sourceFd >= 0)
+        ::close(pack->sourceFd);
+    delete pack;
+
+    return QFile::remove(packPath(packId, ".pack")) && QFile::remove(packPath(packId, ".idx"));
+}
+
+quint64 BlockStore::blockCount()
+{
+    QReadLocker locker(&lock);
+    return index.size();
+}
+
+// One past the highest pack id found by open(), damaged packs included.
+// Packs left by a share that never finished have no file row, but their
+// id must not be handed out again.
+quint32 BlockStore::nextPackId()
+{
+    QReadLocker locker(&lock);
+    return nextId;
+}
@@ -0,0 +1,116 @@
+#ifndef BLOCKSTORE_HH
+#define BLOCKSTORE_HH
+
+#include <QByteArray>
+#include <QString>
+#include <QHash>
+#include <QMultiHash>
+#include <QVector>
+#include <QList>
+#include <QElapsedTimer>
+#include <QReadWriteLock>
+#include <QMutex>
+
+#define PACK_LEGACY     0xFFFFFFFF  // Pack for blocks imported from the old fileData table
+#define IDX_ENTRY_SIZE  64          // bytes, see BlockStore.cc
+#define IDX_FLUSH       512         // Index entries buffered per pack
+#define SOURCE_CHECK    1000        // msec between checks of a shared source file
+#define SOURCE_GROWING  -1          // Source mtime of a file still downloading, only its size is checked
+
+// Index entry flags
+#define IDX_REF         0x01        // Block is read from the source file, not the pack
+
+// Where a block lives: pack (the shared file's id), offset and length in the
+// pack, and the block's index in the file (-1 for metadata). Reference
+// blocks have their offset in the pack's source file instead.
+class BlockLocation
+{
+    public:
+        BlockLocation(quint32 pack = 0, quint64 offset = 0, quint32 length = 0, qint64 idx = -1, quint8 flags = 0);
+
+        quint32 pack;
+        quint64 offset;
+        quint32 length;
+        qint64 idx;
+        quint8 flags;
+};
+
+// One append-only pack file and its index sidecar. Files shared in place
+// also have a source: the original file, which leaf blocks are read from.
+class PackFile
+{
+    public:
+        PackFile(quint32 id);
+
+        quint32 id;
+        int dataFd;
+        int idxFd;
+        quint64 size;           // Bytes of data in the pack
+        QByteArray pendingIdx;  // Index entries not written yet
+        QVector<QByteArray> leaves; // Leaf hashes by block index, for read-ahead
+
+        // Source file, and its size and mtime when it was shared
+        QString sourcePath;
+        quint64 sourceSize;
+        qint64 sourceMtime;
+        int sourceFd;
+        bool stale;             // Source changed, its blocks are not served
+        qint64 lastCheck;       // BlockStore::clock time of the last check
+};
+
+// Content addressed store for block data and metadata. Each shared file
+// gets a <id>.pack file that blocks are appended to, and a <id>.idx file of
+// fixed size entries (hash, offset, length, idx). All indexes are loaded in
+// memory at startup, so reading a block is one hash lookup and one pread().
+// Files shared in place only keep metadata in their pack; their leaf
+// entries point into the source file, which is checked for changes before
+// it is read.
+//
+// Reads (get, locate, readAhead) may run on several threads at once;
+// everything else takes the store's write lock.
+class BlockStore
+{
+    public:
+        BlockStore();
+        ~BlockStore();
+
+        // Loads every pack in dirPath, creating it if needed. created is
+        // set when the directory did not exist.
+        bool open(QString dirPath, bool *created = 0);
+        void close();
+
+        bool insert(quint32 pack, QByteArray hash, QByteArray data, qint64 idx);
+        bool insertRef(quint32 pack, QByteArray hash, qint64 idx, quint64 offset, quint32 length);
+        bool setSource(quint32 pack, QString path, quint64 size, qint64 mtime);
+        bool get(QByteArray hash, BlockLocation &location, QByteArray &data);
+        bool locate(QByteArray hash, BlockLocation &location);
+        int readAhead(const BlockLocation &location, int count, QList<QByteArray> &hashes,
+                      QList<QByteArray> &blocks, QList<qint64> &idxs);
+        bool flush();
+        bool remove(quint32 pack);
+
+        quint64 blockCount();
+        quint32 nextPackId();
+
+    private:
+        QString dirPath;
+        QMultiHash<QByteArray, BlockLocation> index;
+        QHash<quint32, PackFile*> packs;
+        quint32 nextId;         // See nextPackId()
+        QElapsedTimer clock;
+        QReadWriteLock lock;
+        QMutex sourceLock;      // Source checks happen under the read lock
+
+        QString packPath(quint32 id, QString suffix);
+        PackFile* openPack(quint32 id, bool create);
+        bool loadPack(quint32 id);
+        bool flushPack(PackFile *pack);
+        bool findInPack(QByteArray hash, quint32 pack, BlockLocation &location);
+        bool appendEntry(PackFile *pack, QByteArray hash, const BlockLocation &location);
+        void addLeaf(PackFile *pack, const QByteArray &hash, qint64 idx);
+        bool findLeaf(PackFile *pack, qint64 idx, BlockLocation &location);
+        int readFrom(PackFile *pack, const BlockLocation &location);
+        bool checkSource(PackFile *pack);
+};
+
+#endif // BLOCKSTORE_HH
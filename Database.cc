@@ -1,9 +1,19 @@
 #include "Database.hh"
+#include <QQueue>
 
 Database::Database(QObject *parent) : QObject(parent)
 {
     this->cur_id = 0;
-    QObject::connect(this, SIGNAL(fileFound(QString, quint64, QByteArray, quint32)), parent, SLOT(loadSharedFromDB(QString, quint64, QByteArray, quint32)));
+    readers.setMaxThreadCount(STORAGE_READERS);
+    QObject::connect(this, SIGNAL(fileFound(QString, quint64, QByteArray, quint32, quint8)), parent, SLOT(loadSharedFromDB(QString, quint64, QByteArray, quint32, quint8)));
+    QObject::connect(this, SIGNAL(downloadFound(QString, QString, quint64, QByteArray, quint8, quint32, QStringList, QByteArray, QByteArray)),
+                     parent, SLOT(resumeDownload(QString, QString, quint64, QByteArray, quint8, quint32, QStringList, QByteArray, QByteArray)));
+}
+
+Database::~Database()
+{
+    readers.waitForDone();
+    qDebug() << "Block cache:" << cache.stats();
 }
 
 bool Database::openDB()
@@ -15,127 +25,524 @@ bool Database::openDB()
     db.setDatabaseName("seqtube-db-" + QHostInfo::localHostName() + ".sqlite");
 
     // Open databasee
-    return db.open();
+    if (!db.open())
+        return false;
+
+    // Write-ahead log: readers don't wait on writers, and commits are
+    // appends instead of journal rewrites
+    QSqlQuery query(db);
+    if (!query.exec("PRAGMA journal_mode=WAL") || !query.next() || query.value(0).toString() != "wal")
+        qDebug() << "WAL journal not available, using the default";
+    query.exec("PRAGMA synchronous=NORMAL");
+    return true;
 }
 
+// Block data lives in pack files next to the database. If the store is new
+// and there is nothing to import, any files table left over describes data
+// that is gone, so it is dropped.
 bool Database::setUpDataTable()
 {
-    // Create if theres no data table
-    if (!(db.tables().contains("fileData"))){
-        QSqlQuery query;
-        query.prepare("CREATE TABLE fileData (hash, idx, data, id)");
-        if (!query.exec()){
-            qDebug() << query.lastError();
-            return false;
-        }
+    bool created;
+    if (!store.open("seqtube-packs-" + QHostInfo::localHostName(), &created))
+        return false;
 
+    if (created && !db.tables().contains("fileData")){
+        QSqlQuery query(db);
         query.prepare("DROP TABLE files");
         query.exec();
+        setUserVersion(0);
     }
     return true;
 }
 
+// Moves blocks from the fileData table of older versions into the store.
+// Those rows were all written with id 0, so they can't be told apart by
+// file and go to one legacy pack.
+bool Database::importLegacyData()
+{
+    QSqlQuery query(db);
+    quint64 count = 0;
+
+    query.setForwardOnly(true);
+    query.prepare("SELECT hash, idx, data FROM fileData");
+    if (!query.exec()){
+        qDebug() << query.lastError();
+        return false;
+    }
+    while (query.next()){
+        if (!store.insert(PACK_LEGACY, query.value(0).toByteArray(), query.value(2).toByteArray(), query.value(1).toLongLong()))
+            return false;
+        count++;
+    }
+    query.finish();
+    if (!store.flush())
+        return false;
+
+    qDebug() << "Imported" << count << "blocks from fileData";
+    return exec("DROP TABLE fileData");
+}
+
 bool Database::setUpFileTable()
 {
+    if (!migrate())
+        return false;
+
     // Read existing
-    if (db.tables().contains("files")){
-        QSqlQuery query;
-        query.prepare("SELECT * FROM files");
-        query.exec();
-        while (query.next()){
-            if (query.value(0).toInt() > cur_id)
-                cur_id = query.value(0).toInt() + 1;
-            emit fileFound(query.value(1).toString(), query.value(2).toULongLong(), query.value(3).toByteArray(), query.value(0).toUInt());
-        }
+    QSqlQuery query(db);
+    query.setForwardOnly(true);
+    query.prepare("SELECT id, fileName, size, hashHead, hashAlgo, sourcePath, sourceMtime FROM files");
+    if (!query.exec()){
+        qDebug() << query.lastError();
+        return false;
+    }
+    while (query.next()){
+        cur_id = qMax(cur_id, query.value(0).toUInt() + 1);
+        // Shared in place, leaves come from the original file
+        if (!query.value(5).isNull())
+            store.setSource(query.value(0).toUInt(), query.value(5).toString(), query.value(2).toULongLong(), query.value(6).toLongLong());
+        emit fileFound(query.value(1).toString(), query.value(2).toULongLong(), query.value(3).toByteArray(), query.value(0).toUInt(), query.value(4).toUInt());
+    }
+    cur_id = qMax(cur_id, store.nextPackId());
+
+    // Statements run for every share and delete are prepared once
+    insertFileQuery = QSqlQuery(db);
+    deleteFileQuery = QSqlQuery(db);
+    return insertFileQuery.prepare("INSERT INTO files (id, fileName, size, hashHead, hashAlgo, sourcePath, sourceMtime) VALUES (?, ?, ?, ?, ?, ?, ?)")
+        && deleteFileQuery.prepare("DELETE FROM files WHERE id=?");
+}
+
+// Unfinished downloads, checkpointed by Node. Needs setUpFileTable() first,
+// for the migrations. Downloads have file ids too (their blocks are served
+// while they download), so those are reserved before any download resumes.
+bool Database::setUpDownloadTable()
+{
+    QSqlQuery query(db);
+    query.setForwardOnly(true);
+    if (!query.exec("SELECT MAX(fileId) FROM downloads")){
+        qDebug() << query.lastError();
+        return false;
+    }
+    if (query.next() && !query.value(0).isNull())
+        cur_id = qMax(cur_id, query.value(0).toUInt() + 1);
+    query.finish();
+
+    // Prepared first: resumeDownload() runs inside the loop below, and may
+    // save or delete its row right away
+    saveDownloadQuery = QSqlQuery(db);
+    deleteDownloadQuery = QSqlQuery(db);
+    if (!saveDownloadQuery.prepare("INSERT OR REPLACE INTO downloads (hashHead, fileName, path, size, hashAlgo, fileId, peers, fileMap, frontier) "
+                                   "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)")
+        || !deleteDownloadQuery.prepare("DELETE FROM downloads WHERE hashHead=?")){
+        qDebug() << db.lastError();
+        return false;
+    }
+
+    query.prepare("SELECT fileName, path, size, hashHead, hashAlgo, fileId, peers, fileMap, frontier FROM downloads");
+    if (!query.exec()){
+        qDebug() << query.lastError();
+        return false;
     }
-    // Create
-    else{
-        QSqlQuery query;
-        query.prepare("CREATE TABLE files (id, fileName, size, hashHead)");
-        if (!query.exec()){
-            qDebug() << query.lastError();
+    while (query.next()){
+        quint32 fileId = query.value(5).isNull() ? reserveFileId() : query.value(5).toUInt();
+        emit downloadFound(query.value(0).toString(), query.value(1).toString(), query.value(2).toULongLong(),
+                           query.value(3).toByteArray(), query.value(4).toUInt(), fileId,
+                           query.value(6).toString().split("\n", QString::SkipEmptyParts),
+                           query.value(7).toByteArray(), query.value(8).toByteArray());
+    }
+    return true;
+}
+
+// #### SCHEMA ####
+
+// Brings the schema up to SCHEMA_VERSION, one step at a time. Each step runs
+// in a transaction together with its version bump.
+bool Database::migrate()
+{
+    int version = userVersion();
+    if (version > SCHEMA_VERSION){
+        qDebug() << "Database schema" << version << "is newer than this program's" << SCHEMA_VERSION;
+        return false;
+    }
+
+    while (version < SCHEMA_VERSION){
+        db.transaction();
+        bool ok = false;
+        switch (version){
+            case 0:
+                ok = migrateToTyped();
+                break;
+            case 1:
+                ok = migrateToInPlace();
+                break;
+            case 2:
+                ok = migrateToDownloads();
+                break;
+            case 3:
+                ok = migrateToSeeding();
+                break;
+        }
+        ok = ok && setUserVersion(version + 1);
+        if (!ok || !db.commit()){
+            qDebug() << "Migration from schema" << version << "failed";
+            db.rollback();
             return false;
         }
+        qDebug() << "Migrated database to schema" << version + 1;
+        version++;
     }
     return true;
 }
 
-quint32 Database::insertFile(QString fileName, quint64 size, QByteArray hashHead)
+// Schema 0 is everything from before schemas were versioned: an untyped
+// files table (maybe without hashAlgo) and maybe block data in fileData.
+// The files table is rebuilt typed, with id as the primary key. Older
+// versions could hand out the same id twice, such files get new ids (their
+// blocks are in the legacy pack anyway).
+bool Database::migrateToTyped()
 {
-    QSqlQuery query;
-    query.prepare("INSERT INTO files (id, fileName, size, hashHead) VALUES (:id, :fileName, :size, :hashHead)");
-    query.bindValue(":id", QVariant(cur_id++));
-    query.bindValue(":fileName", QVariant(fileName));
-    query.bindValue(":size", QVariant(size));
-    query.bindValue(":hashHead", QVariant(hashHead));
-    query.exec();
-    return cur_id;
+    if (db.tables().contains("fileData") && !importLegacyData())
+        return false;
+
+    bool hadFiles = db.tables().contains("files");
+    bool hadAlgo = hadFiles && db.record("files").contains("hashAlgo");
+
+    if (hadFiles && !exec("ALTER TABLE files RENAME TO files_v0"))
+        return false;
+
+    if (!exec("CREATE TABLE files ("
+              "id INTEGER PRIMARY KEY, "
+              "fileName TEXT NOT NULL, "
+              "size INTEGER NOT NULL, "
+              "hashHead BLOB NOT NULL, "
+              "hashAlgo INTEGER NOT NULL DEFAULT " + QString::number(HASH_SHA1) + ")"))
+        return false;
+
+    if (hadFiles){
+        QString algo = hadAlgo ? "COALESCE(hashAlgo, " + QString::number(HASH_SHA1) + ")" : QString::number(HASH_SHA1);
+        if (!exec("INSERT INTO files (id, fileName, size, hashHead, hashAlgo) "
+                  "SELECT CASE WHEN CAST(id AS INTEGER) IN "
+                  "(SELECT CAST(id AS INTEGER) FROM files_v0 GROUP BY CAST(id AS INTEGER) HAVING COUNT(*) > 1) "
+                  "THEN NULL ELSE CAST(id AS INTEGER) END, "
+                  "fileName, size, hashHead, " + algo + " FROM files_v0"))
+            return false;
+        if (!exec("DROP TABLE files_v0"))
+            return false;
+    }
+    return true;
 }
 
-bool Database::deleteFile(quint32 id)
+// Schema 2 adds the source of files shared in place. Both are NULL for files
+// whose blocks were copied into their pack.
+bool Database::migrateToInPlace()
+{
+    return exec("ALTER TABLE files ADD COLUMN sourcePath TEXT")
+        && exec("ALTER TABLE files ADD COLUMN sourceMtime INTEGER");
+}
+
+// Schema 3 checkpoints unfinished downloads: the leaf bitmap and the tree
+// frontier still to fetch, both serialized with QDataStream
+bool Database::migrateToDownloads()
+{
+    // The table outlives a reset to schema 0 (see setUpDataTable)
+    return exec("CREATE TABLE IF NOT EXISTS downloads ("
+                "hashHead BLOB PRIMARY KEY, "
+                "fileName TEXT NOT NULL, "
+                "path TEXT NOT NULL, "
+                "size INTEGER NOT NULL, "
+                "hashAlgo INTEGER NOT NULL, "
+                "peers TEXT NOT NULL, "
+                "fileMap BLOB NOT NULL, "
+                "frontier BLOB NOT NULL)");
+}
+
+// Schema 4 gives downloads the id of the pack their verified blocks are
+// served from, and that the file keeps once it completes. NULL for
+// downloads checkpointed before, they get a new id when they resume.
+// Resetting to schema 0 keeps downloads, which may have the column already.
+bool Database::migrateToSeeding()
 {
-    db.transaction();
-    QSqlQuery deleteFromFiles, deleteData;
-    deleteFromFiles.prepare("DELETE FROM files WHERE id=:thisId");
-    deleteFromFiles.bindValue(":thisId", id);
-    deleteFromFiles.exec();
+    QSqlQuery query(db);
+    if (!query.exec("PRAGMA table_info(downloads)"))
+        return false;
+    while (query.next()){
+        if (query.value(1).toString() == "fileId")
+            return true;
+    }
+    return exec("ALTER TABLE downloads ADD COLUMN fileId INTEGER");
+}
+
+int Database::userVersion()
+{
+    QSqlQuery query(db);
+    if (query.exec("PRAGMA user_version") && query.next())
+        return query.value(0).toInt();
+    return 0;
+}
+
+bool Database::setUserVersion(int version)
+{
+    return exec("PRAGMA user_version = " + QString::number(version));
+}
 
-    deleteData.prepare("DELETE FROM fileData WHERE id=:thisId");
-    deleteData.bindValue(":thisId", id);
-    deleteData.exec();
-    db.commit();
+bool Database::exec(QString statement)
+{
+    QSqlQuery query(db);
+    if (!query.exec(statement)){
+        qDebug() << query.lastError() << statement;
+        return false;
+    }
     return true;
 }
 
-bool Database::insertData(quint32 id, QByteArray hash, QByteArray data, qint64 idx)
+// Ids are handed out before a file's Merkle tree is built, so its blocks can
+// go to the file's own pack
+quint32 Database::reserveFileId()
 {
-    pendingHashes << QVariant(hash);
-    pendingIdxs << QVariant(idx);
-    pendingData << QVariant(data);
-    pendingIds << QVariant(id);
+    return cur_id++;
+}
 
-    if (pendingHashes.size() > 500){
-        execDataInserts();
+// sourcePath is set for files shared in place, and is where their leaf
+// blocks will be read from
+bool Database::insertFile(quint32 id, QString fileName, quint64 size, QByteArray hashHead, quint8 hashAlgo,
+                          QString sourcePath, qint64 sourceMtime)
+{
+    insertFileQuery.bindValue(0, QVariant(id));
+    insertFileQuery.bindValue(1, QVariant(fileName));
+    insertFileQuery.bindValue(2, QVariant(size));
+    insertFileQuery.bindValue(3, QVariant(hashHead));
+    insertFileQuery.bindValue(4, QVariant((uint) hashAlgo));
+    insertFileQuery.bindValue(5, sourcePath.isEmpty() ? QVariant(QVariant::String) : QVariant(sourcePath));
+    insertFileQuery.bindValue(6, sourcePath.isEmpty() ? QVariant(QVariant::LongLong) : QVariant(sourceMtime));
+    if (!insertFileQuery.exec()){
+        qDebug() << insertFileQuery.lastError();
+        return false;
     }
 
+    if (!sourcePath.isEmpty())
+        return store.setSource(id, sourcePath, size, sourceMtime);
     return true;
 }
 
-bool Database::execDataInserts()
+// Writes stay on the calling thread, the event thread for downloads: the
+// caller relies on them being done when they return. resumeDownload()
+// reuses the pack id right after deleting it, and metadata is served as
+// soon as it is inserted. Bulk inserts come from ShareJob, on the share
+// pool. Deleting takes the write lock for one pass over the pack's index.
+bool Database::deleteFile(quint32 id)
 {
-    db.transaction();
-    QSqlQuery dataQuery;
-    dataQuery.prepare("INSERT INTO fileData (hash, idx, data, id) VALUES (?, ?, ?, ?)");
-    dataQuery.addBindValue(pendingHashes);
-    dataQuery.addBindValue(pendingIdxs);
-    dataQuery.addBindValue(pendingData);
-    dataQuery.addBindValue(pendingIds);
+    deleteFileQuery.bindValue(0, QVariant(id));
+    if (!deleteFileQuery.exec())
+        qDebug() << deleteFileQuery.lastError();
 
-    if (!dataQuery.execBatch()){
+    // Cached blocks of the file must not be served anymore
+    store.remove(id);
+    cache.clear();
+    return true;
+}
+
+bool Database::saveDownload(QByteArray hashHead, QString fileName, QString path, quint64 size, quint8 hashAlgo,
+                            quint32 fileId, QStringList peers, QByteArray fileMap, QByteArray frontier)
+{
+    saveDownloadQuery.bindValue(0, QVariant(hashHead));
+    saveDownloadQuery.bindValue(1, QVariant(fileName));
+    saveDownloadQuery.bindValue(2, QVariant(path));
+    saveDownloadQuery.bindValue(3, QVariant(size));
+    saveDownloadQuery.bindValue(4, QVariant((uint) hashAlgo));
+    saveDownloadQuery.bindValue(5, QVariant(fileId));
+    saveDownloadQuery.bindValue(6, QVariant(peers.join("\n")));
+    saveDownloadQuery.bindValue(7, QVariant(fileMap));
+    saveDownloadQuery.bindValue(8, QVariant(frontier));
+    if (!saveDownloadQuery.exec()){
+        qDebug() << saveDownloadQuery.lastError();
         return false;
-        qDebug() << dataQuery.lastError();
     }
-    db.commit();
+    return true;
+}
 
-    pendingHashes.clear();
-    pendingIdxs.clear();
-    pendingData.clear();
-    pendingIds.clear();
+bool Database::deleteDownload(QByteArray hashHead)
+{
+    deleteDownloadQuery.bindValue(0, QVariant(hashHead));
+    if (!deleteDownloadQuery.exec()){
+        qDebug() << deleteDownloadQuery.lastError();
+        return false;
+    }
     return true;
 }
 
+// One append to the pack, the index entry is buffered until
+// execDataInserts(). Runs on the caller's thread, see deleteFile().
+bool Database::insertData(quint32 id, QByteArray hash, QByteArray data, qint64 idx)
+{
+    return store.insert(id, hash, data, idx);
+}
+
+bool Database::insertRef(quint32 id, QByteArray hash, qint64 idx, quint64 offset, quint32 length)
+{
+    return store.insertRef(id, hash, idx, offset, length);
+}
+
+// Points a pack's reference blocks at sourcePath. For a file that is still
+// being written, sourceMtime is SOURCE_GROWING.
+bool Database::setSource(quint32 id, QString sourcePath, quint64 size, qint64 sourceMtime)
+{
+    return store.setSource(id, sourcePath, size, sourceMtime);
+}
+
+// Serves a block from memory until it is in the store. The cache outlives
+// the caller's buffer, so it keeps its own copy of anything that is a view
+// (QByteArray::fromRawData()) into one.
+void Database::cacheBlock(QByteArray hash, qint64 idx, QByteArray data)
+{
+    data.detach();
+    cache.insert(hash, idx, data);
+}
+
+// Writes out buffered pack index entries
+bool Database::execDataInserts()
+{
+    return store.flush();
+}
+
+// Serves from the cache when possible, blocking on storage otherwise
 QPair<qint64, QByteArray> Database::get(QByteArray hash)
 {
-    QSqlQuery query;
-    query.prepare("SELECT * FROM fileData WHERE hash=:thisHash");
-    query.bindValue(":thisHash", hash);
-    query.exec();
-    if (query.first()){
-        return QPair<qint64, QByteArray>(query.value(1).toInt(), query.value(2).toByteArray());
+    qint64 idx;
+    QByteArray data;
+
+    if (cache.lookup(hash, idx, data))
+        return QPair<qint64, QByteArray>(idx, data);
+    return load(hash);
+}
+
+// Never blocks on storage: false if the block isn't cached
+bool Database::getCached(QByteArray hash, qint64 &idx, QByteArray &data)
+{
+    return cache.lookup(hash, idx, data);
+}
+
+// Reads blocks on the reader pool, blockRead() is emitted as each is done.
+// Reads run in parallel with each other and with share-time inserts, which
+// only hold the store's write lock for an append. The blocks of one call are
+// read in order by the same reader, and a leaf read reads ahead at least as
+// far as the rest of the batch, so a batch of consecutive leaves is usually
+// one storage access.
+void Database::getAsync(QList<QByteArray> hashes)
+{
+    readers.start(new BlockRead(this, hashes));
+}
+
+// Called on a reader thread
+void Database::readBlocks(QList<QByteArray> hashes)
+{
+    for (int i = 0; i < hashes.size(); ++i){
+        QPair<qint64, QByteArray> block;
+        if (i == 0 || !cache.lookup(hashes.at(i), block.first, block.second))
+            block = load(hashes.at(i), qMax(READAHEAD_LEAVES, hashes.size() - i - 1));
+        emit blockRead(hashes.at(i), block.first, block.second);
+    }
+}
+
+// Metadata block of a subtree being read, see readSubtree()
+struct SubtreeNode
+{
+    QByteArray hash;
+    QPair<qint64, QByteArray> block;
+    int depth;  // Levels still to read below it
+};
+
+void Database::getSubtreeAsync(QString origin, QByteArray hash, int depth)
+{
+    readers.start(new SubtreeRead(this, origin, hash, depth));
+}
+
+// Reads hash and the metadata blocks below it, breadth first, down to depth
+// levels and up to SUBTREE_BLOCKS blocks. Each block is emitted before its
+// children, with the number of them that follow: always its first ones, as
+// a child that is a leaf or missing ends the list.
+void Database::readSubtree(QString origin, QByteArray hash, int depth)
+{
+    SubtreeNode head;
+    head.hash = hash;
+    head.block = get(hash);
+    head.depth = depth;
+    if (head.block.first == DB_NOT_FOUND)
+        return;
+
+    QQueue<SubtreeNode> nodes;
+    nodes.enqueue(head);
+    int budget = SUBTREE_BLOCKS - 1;
+    while (!nodes.isEmpty()){
+        SubtreeNode node = nodes.dequeue();
+        int following = 0;
+        // Leaves have an index, metadata -1
+        if (node.block.first == -1 && node.depth > 0){
+            const QByteArray &data = node.block.second;
+            int hashSize = node.hash.size();
+            for (int pos = 0; pos + hashSize <= data.size() && budget > 0; pos += hashSize){
+                SubtreeNode child;
+                child.hash = data.mid(pos, hashSize);
+                child.depth = node.depth - 1;
+                // The index tells a leaf apart, reading one would pull its
+                // read-ahead into the cache for nothing
+                BlockLocation location;
+                if (!store.locate(child.hash, location) || location.idx != -1)
+                    break;
+                child.block = get(child.hash);
+                if (child.block.first != -1)
+                    break;
+                nodes.enqueue(child);
+                following++;
+                budget--;
+            }
+        }
+        emit subtreeRead(origin, node.hash, node.block.first, node.block.second, following);
     }
-    else{
+}
+
+// Reads a block from storage into the cache. A leaf missing from the cache is
+// likely followed by requests for the leaves after it (downloaders walk the
+// tree in order), so those are read ahead into the cache.
+QPair<qint64, QByteArray> Database::load(QByteArray hash, int readAhead)
+{
+    BlockLocation location;
+    QByteArray data;
+
+    if (!store.get(hash, location, data))
         return QPair<qint64, QByteArray>(DB_NOT_FOUND, QByteArray());
+
+    cache.insert(hash, location.idx, data);
+    if (location.idx >= 0){
+        QList<QByteArray> hashes, blocks;
+        QList<qint64> idxs;
+        store.readAhead(location, readAhead, hashes, blocks, idxs);
+        for (int i = 0; i < hashes.size(); ++i)
+            cache.insert(hashes.at(i), idxs.at(i), blocks.at(i), true);
     }
+    return QPair<qint64, QByteArray>(location.idx, data);
+}
+
+BlockRead::BlockRead(Database *db, QList<QByteArray> hashes)
+{
+    this->db = db;
+    this->hashes = hashes;
+}
+
+void BlockRead::run()
+{
+    db->readBlocks(hashes);
+}
+
+SubtreeRead::SubtreeRead(Database *db, QString origin, QByteArray hash, int depth)
+{
+    this->db = db;
+    this->origin = origin;
+    this->hash = hash;
+    this->depth = depth;
+}
+
+void SubtreeRead::run()
+{
+    db->readSubtree(origin, hash, depth);
 }
 
 QSqlError Database::lastError()
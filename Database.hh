@@ -10,40 +10,114 @@
 #include <QDebug>
 #include <QObject>
 #include <QHostInfo>
+#include <QSqlRecord>
+#include <QStringList>
+#include <QThreadPool>
+#include <QRunnable>
+#include "hashsum.hh"
+#include "BlockStore.hh"
+#include "BlockCache.hh"
 
 #define FILE_INCOMPLETE 0
 #define FILE_COMPLETE   1
 
 #define DB_NOT_FOUND -2
 
+#define SCHEMA_VERSION  4   // PRAGMA user_version, see Database::migrate()
+
+#define STORAGE_READERS 4   // Block reads running at once
+#define SUBTREE_BLOCKS  64  // Most blocks read for one subtree request
+
 class Database : public QObject
 {
     Q_OBJECT
 
     public:
         Database(QObject *parent = 0);
+        ~Database();
         bool openDB();
         bool deleteDB();
         QSqlError lastError();
         bool setUpDataTable();
         bool setUpFileTable();
-        quint32 insertFile(QString fileName, quint64 size, QByteArray hashHead);
+        bool setUpDownloadTable();
+        quint32 reserveFileId();
+        bool insertFile(quint32 id, QString fileName, quint64 size, QByteArray hashHead, quint8 hashAlgo,
+                        QString sourcePath = QString(), qint64 sourceMtime = 0);
         bool insertData(quint32 id, QByteArray hash, QByteArray data, qint64 idx);
+        bool insertRef(quint32 id, QByteArray hash, qint64 idx, quint64 offset, quint32 length);
+        bool setSource(quint32 id, QString sourcePath, quint64 size, qint64 sourceMtime);
+        void cacheBlock(QByteArray hash, qint64 idx, QByteArray data);
         QPair<qint64, QByteArray> get(QByteArray hash);
+        bool getCached(QByteArray hash, qint64 &idx, QByteArray &data);
+        void getAsync(QList<QByteArray> hashes);
+        void readBlocks(QList<QByteArray> hashes);
+        void getSubtreeAsync(QString origin, QByteArray hash, int depth);
+        void readSubtree(QString origin, QByteArray hash, int depth);
         bool execDataInserts();
         bool deleteFile(quint32 id);
+        bool saveDownload(QByteArray hashHead, QString fileName, QString path, quint64 size, quint8 hashAlgo,
+                          quint32 fileId, QStringList peers, QByteArray fileMap, QByteArray frontier);
+        bool deleteDownload(QByteArray hashHead);
 
     private:
         QSqlDatabase db;
         quint32 cur_id;
+        BlockStore store;   // Block data and metadata, in pack files
+        BlockCache cache;   // Recently served blocks
+        QSqlQuery insertFileQuery;
+        QSqlQuery deleteFileQuery;
+        QSqlQuery saveDownloadQuery;
+        QSqlQuery deleteDownloadQuery;
+        QThreadPool readers; // Runs getAsync() reads, see BlockRead
 
-        QVariantList pendingHashes;
-        QVariantList pendingIdxs;
-        QVariantList pendingData;
-        QVariantList pendingIds;
+        QPair<qint64, QByteArray> load(QByteArray hash, int readAhead = READAHEAD_LEAVES);
+        bool importLegacyData();
+
+        // Schema versions and migrations
+        bool migrate();
+        bool migrateToTyped();
+        bool migrateToInPlace();
+        bool migrateToDownloads();
+        bool migrateToSeeding();
+        int userVersion();
+        bool setUserVersion(int version);
+        bool exec(QString statement);
 
     signals:
-        void fileFound(QString, quint64, QByteArray, quint32);
+        void fileFound(QString, quint64, QByteArray, quint32, quint8);
+        void downloadFound(QString fileName, QString path, quint64 size, QByteArray hashHead, quint8 hashAlgo,
+                           quint32 fileId, QStringList peers, QByteArray fileMap, QByteArray frontier);
+        // Completion of getAsync(), idx is DB_NOT_FOUND if the block is missing
+        void blockRead(QByteArray hash, qint64 idx, QByteArray data);
+        // One block of getSubtreeAsync(), followed by the first following of its children
+        void subtreeRead(QString origin, QByteArray hash, qint64 idx, QByteArray data, int following);
+};
+
+// One getAsync() batch, run by the storage reader pool
+class BlockRead : public QRunnable
+{
+    public:
+        BlockRead(Database *db, QList<QByteArray> hashes);
+        void run();
+
+    private:
+        Database *db;
+        QList<QByteArray> hashes;
+};
+
+// One getSubtreeAsync() read, run by the storage reader pool
+class SubtreeRead : public QRunnable
+{
+    public:
+        SubtreeRead(Database *db, QString origin, QByteArray hash, int depth);
+        void run();
+
+    private:
+        Database *db;
+        QString origin;
+        QByteArray hash;
+        int depth;
 };
 
 #endif // DATABASE_H
@@ -0,0 +1,181 @@
+#include "DownloadWriter.hh"
+#include <QFile>
+#include <QDebug>
+#include <QVarLengthArray>
+#include <QtConcurrentRun>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static bool syncFile(int fd)
+{
+    return ::fdatasync(fd) == 0;
+}
+
+DownloadWriter::DownloadWriter()
+{
+    fd = -1;
+    blockSize = 1;
+    pendingBytes = 0;
+    blocks = 0;
+    syscalls = 0;
+}
+
+DownloadWriter::~DownloadWriter()
+{
+    close();
+}
+
+// Preallocating keeps the file from fragmenting as blocks come in out of
+// order. Filesystems without fallocate just get the size set.
+bool DownloadWriter::open(QString filePath, quint64 size, int blockSize)
+{
+    close();
+    this->blockSize = blockSize;
+
+    QByteArray path = QFile::encodeName(filePath);
+    fd = ::open(path.constData(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0){
+        qDebug() << "Can't open download" << filePath << strerror(errno);
+        return false;
+    }
+
+    int err = size > 0 ? ::posix_fallocate(fd, 0, size) : 0;
+    if (err != 0 && ::ftruncate(fd, size) != 0){
+        qDebug() << "Can't allocate download" << filePath << strerror(errno);
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+// Waits for a running sync, the descriptor must outlive it
+void DownloadWriter::close()
+{
+    if (fd < 0)
+        return;
+    flush();
+    syncing.waitForFinished();
+    ::close(fd);
+    fd = -1;
+}
+
+bool DownloadWriter::write(quint64 idx, const QByteArray &data)
+{
+    if (fd < 0)
+        return false;
+
+    if (!pending.contains(idx)){
+        pending.insert(idx, data);
+        pendingBytes += data.size();
+        blocks++;
+    }
+    if (pendingBytes >= WRITER_BUFFER)
+        return flush();
+    return true;
+}
+
+// Blocks still in the buffer haven't reached the file yet
+bool DownloadWriter::read(quint64 idx, int length, QByteArray &data)
+{
+    if (pending.contains(idx)){
+        data = pending.value(idx);
+        return true;
+    }
+    if (fd < 0)
+        return false;
+
+    data.resize(length);
+    qint64 got = ::pread(fd, data.data(), length, idx * blockSize);
+    if (got != length){
+        data.clear();
+        return false;
+    }
+    return true;
+}
+
+// Writes the buffered blocks, one pwritev() per run of adjacent blocks. A
+// run that fails is recorded whole in failed, some of it may be on disk.
+bool DownloadWriter::flush()
+{
+    bool ok = true;
+    QMap<quint64, QByteArray>::const_iterator first = pending.constBegin();
+    while (first != pending.constEnd()){
+        QMap<quint64, QByteArray>::const_iterator end = first + 1;
+        int count = 1;
+        while (end != pending.constEnd() && end.key() == (end - 1).key() + 1 && count < IOV_MAX){
+            ++end;
+            ++count;
+        }
+        if (!writeRun(first, end)){
+            for (QMap<quint64, QByteArray>::const_iterator it = first; it != end; ++it)
+                failed << it.key();
+            ok = false;
+        }
+        first = end;
+    }
+    pending.clear();
+    pendingBytes = 0;
+    return ok;
+}
+
+QList<quint64> DownloadWriter::takeFailed()
+{
+    QList<quint64> blocks = failed;
+    failed.clear();
+    return blocks;
+}
+
+bool DownloadWriter::writeRun(QMap<quint64, QByteArray>::const_iterator first,
+                              QMap<quint64, QByteArray>::const_iterator end)
+{
+    QVarLengthArray<struct iovec, 128> iov;
+    ssize_t total = 0;
+    for (QMap<quint64, QByteArray>::const_iterator it = first; it != end; ++it){
+        struct iovec v;
+        v.iov_base = (void*) it->constData();
+        v.iov_len = it->size();
+        iov.append(v);
+        total += it->size();
+    }
+
+    off_t offset = (off_t) first.key() * blockSize;
+    ssize_t written = ::pwritev(fd, iov.constData(), iov.size(), offset);
+    syscalls++;
+    if (written == total)
+        return true;
+
+    // Short write: finish it block by block
+    if (written < 0)
+        written = 0;
+    for (QMap<quint64, QByteArray>::const_iterator it = first; it != end; ++it){
+        off_t at = (off_t) it.key() * blockSize;
+        if (at + it->size() <= offset + written)
+            continue;
+        int skip = qMax((off_t) 0, offset + written - at);
+        syscalls++;
+        if (::pwrite(fd, it->constData() + skip, it->size() - skip, at + skip) != it->size() - skip){
+            qDebug() << "Download write failed at block" << it.key() << strerror(errno);
+            return false;
+        }
+    }
+    return true;
+}
+
+QFuture<bool> DownloadWriter::sync()
+{
+    if (fd < 0)
+        return QFuture<bool>();
+    flush();
+    if (!syncing.isRunning())
+        syncing = QtConcurrent::run(syncFile, fd);
+    return syncing;
+}
@@ -0,0 +1,55 @@
+#ifndef DOWNLOADWRITER_HH
+#define DOWNLOADWRITER_HH
+
+#include <QByteArray>
+#include <QString>
+#include <QMap>
+#include <QList>
+#include <QFuture>
+
+#define WRITER_BUFFER   (1024 * 1024)   // Bytes of blocks held before writing
+
+// Writes the blocks of one download. The file stays open for the whole
+// download and is preallocated up front. Blocks are buffered and written
+// in runs of adjacent blocks, one pwritev() per run, so most blocks cost
+// no syscall at all. fdatasync() runs on the global thread pool when
+// sync() is called, not on the caller's thread.
+class DownloadWriter
+{
+    public:
+        DownloadWriter();
+        ~DownloadWriter();
+
+        // Opens (creating if needed) and preallocates the file
+        bool open(QString filePath, quint64 size, int blockSize);
+        void close();
+        bool isOpen() const { return fd >= 0; }
+
+        bool write(quint64 idx, const QByteArray &data);
+        // Reads a block back, from the buffer if it isn't written yet
+        bool read(quint64 idx, int length, QByteArray &data);
+        bool flush();
+        // Blocks a flush could not write, since the last call. They are
+        // dropped from the buffer and have to be fetched again.
+        QList<quint64> takeFailed();
+        // Flushes, then syncs the file in the background. A sync already
+        // running is returned instead of starting another.
+        QFuture<bool> sync();
+
+        // Statistics
+        quint64 blocks;
+        quint64 syscalls;
+
+    private:
+        int fd;
+        int blockSize;
+        QMap<quint64, QByteArray> pending;  // Blocks not written yet, by index
+        QList<quint64> failed;              // See takeFailed()
+        int pendingBytes;
+        QFuture<bool> syncing;
+
+        bool writeRun(QMap<quint64, QByteArray>::const_iterator first,
+                      QMap<quint64, QByteArray>::const_iterator end);
+};
+
+#endif // DOWNLOADWRITER_HH
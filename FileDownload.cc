@@ -1,14 +1,117 @@
 #include "main.hh"
 
-FileDownload::FileDownload(QString fileName, QString path, quint64 size, QByteArray hashHead, QList<QString> peers)
+FileDownload::FileDownload(QString fileName, QString path, quint64 size, QByteArray hashHead, quint8 hashAlgo,
+                           quint32 fileId, QList<QString> peers)
+    : blockQ(HASHESPERBLOCK(hashAlgo))
 {
     this->fileName = fileName;
     this->path = path;
     this->size = size;
     this->hashHead = hashHead;
+    this->hashAlgo = hashAlgo;
+    this->fileId = fileId;
     this->peers = peers;
-    this->freePeers = peers;
     this->fileMap.resize(CEILING(size,BLOCKSIZE));
+    this->dirty = true;
+    this->leafLevel = -1;
+    this->playhead = -1;
+    this->received = 0;
+    this->watermark = 0;
+    this->receivedAtStart = 0;
+    started.start();
+
+    connect(&syncWatcher, SIGNAL(finished()), this, SLOT(syncFinished()));
+}
+
+void FileDownload::syncFinished()
+{
+    emit synced(this);
+}
+
+// Checkpoint state: blocks on disk, and the frontier of the tree still to
+// fetch (queued and in flight). Everything else is below the frontier, so
+// the metadata blocks already fetched don't have to be kept.
+QByteArray FileDownload::savedFileMap() const
+{
+    QByteArray bytes;
+    QDataStream out(&bytes, QIODevice::WriteOnly);
+    out << fileMap;
+    return bytes;
+}
+
+QByteArray FileDownload::savedFrontier() const
+{
+    BlockQueue frontier = blockQ;
+    QMultiHash<QByteArray, BlockRequest*>::const_iterator it;
+    for (it = pendingReqs.constBegin(); it != pendingReqs.constEnd(); ++it)
+        frontier.insert((*it)->position, (*it)->hash);
+
+    QByteArray bytes;
+    QDataStream out(&bytes, QIODevice::WriteOnly);
+    frontier.save(out);
+    return bytes;
+}
+
+bool FileDownload::restore(QByteArray savedMap, QByteArray savedFrontier)
+{
+    QBitArray map;
+    QDataStream inMap(savedMap);
+    inMap >> map;
+    if (inMap.status() != QDataStream::Ok || map.size() != fileMap.size())
+        return false;
+
+    QDataStream inFrontier(savedFrontier);
+    if (!blockQ.load(inFrontier))
+        return false;
+    fileMap = map;
+    dirty = false;
+
+    // Once per resume, from then on markReceived() keeps these
+    received = fileMap.count(true);
+    receivedAtStart = received;
+    watermark = 0;
+    while (watermark < (quint64) fileMap.size() && fileMap.testBit(watermark))
+        watermark++;
+    return true;
+}
+
+// Sets the block's bit, false if it was already set. The watermark only
+// moves forward, so keeping it costs O(1) per block overall.
+bool FileDownload::markReceived(quint64 idx)
+{
+    if (idx >= (quint64) fileMap.size() || fileMap.testBit(idx))
+        return false;
+    fileMap.setBit(idx);
+    received++;
+    while (watermark < (quint64) fileMap.size() && fileMap.testBit(watermark))
+        watermark++;
+    return true;
+}
+
+// Clears the block's bit, for a block lost before it reached the disk
+void FileDownload::unmarkReceived(quint64 idx)
+{
+    if (idx >= (quint64) fileMap.size() || !fileMap.testBit(idx))
+        return;
+    fileMap.clearBit(idx);
+    received--;
+    watermark = qMin(watermark, idx);
+}
+
+double FileDownload::rate() const
+{
+    qint64 msec = started.elapsed();
+    if (msec <= 0)
+        return 0;
+    return (received - receivedAtStart) * (double) BLOCKSIZE * 1000 / msec;
+}
+
+qint64 FileDownload::eta() const
+{
+    double bytesPerSec = rate();
+    if (bytesPerSec <= 0)
+        return -1;
+    return (fileMap.size() - received) * (double) BLOCKSIZE / bytesPerSec;
 }
 
 // Delete data in pendingReqs
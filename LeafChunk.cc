@@ -0,0 +1,31 @@
+#include "main.hh"
+#include "hashsum.hh"
+
+LeafChunk::LeafChunk(QString filePath, qint64 first, int count, quint8 hashAlgo, bool keepBlocks)
+{
+    this->filePath = filePath;
+    this->hashAlgo = hashAlgo;
+    this->keepBlocks = keepBlocks;
+    this->first = first;
+    this->count = count;
+}
+
+// Reads and hashes the blocks of one chunk. Runs on a worker thread, so it
+// opens its own handle to the file. The chunk is read in one go and its
+// blocks are hashed together.
+LeafChunk hashLeafChunk(const LeafChunk &chunk)
+{
+    LeafChunk hashed = chunk;
+    QFile file(chunk.filePath);
+
+    if (!file.open(QIODevice::ReadOnly) || !file.seek(chunk.first * BLOCKSIZE)){
+        qDebug() << "Error reading file" << chunk.filePath;
+        return hashed;
+    }
+
+    QByteArray raw = file.read((qint64) chunk.count * BLOCKSIZE);
+    hashed.hashes = hashsumBlocks(chunk.hashAlgo, raw.constData(), raw.size(), BLOCKSIZE);
+    for (int i = 0; chunk.keepBlocks && i < hashed.hashes.size(); ++i)
+        hashed.blocks << raw.mid(i * BLOCKSIZE, BLOCKSIZE);
+    return hashed;
+}
@@ -1,4 +1,8 @@
 #include "main.hh"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <errno.h>
 
 NetSocket::NetSocket()
 {
@@ -11,6 +15,34 @@ NetSocket::NetSocket()
 	// We use the range from 32768 to 49151 for this purpose.
 	myPortMin = 32768 + (getuid() % 4096)*4;
 	myPortMax = myPortMin + 3;
+
+	// Datagrams are received straight into this pool and handed out as views
+	recvPool = new char[RECV_BATCH * MAX_DATAGRAM];
+
+	rxPackets = 0;
+	rxBatches = 0;
+	rxTruncated = 0;
+	rxDropped = 0;
+
+	txPackets = 0;
+	txBatches = 0;
+	txDropped = 0;
+	txQueued = 0;
+	txMaxQueued = 0;
+
+	// Outgoing datagrams are queued and flushed together once control
+	// gets back to the event loop
+	paceRate = PACE_RATE;
+	lastRefill = 0;
+	paceClock.start();
+	flushTimer.setSingleShot(true);
+	connect(&flushTimer, SIGNAL(timeout()), this, SLOT(flushSendQueue()));
+}
+
+NetSocket::~NetSocket()
+{
+	delete[] recvPool;
+	qDeleteAll(sendQueues);
 }
 
 bool NetSocket::bind()
@@ -20,6 +52,20 @@ bool NetSocket::bind()
 		if (QUdpSocket::bind(p)) {
 			port = p;
 			//~ qDebug() << "UDP port:" << p;
+
+			// Bigger kernel buffer, so bursts of replies are not dropped
+			// before the event loop gets to them
+			int fd = socketDescriptor();
+			int rcvbuf = RECV_BUFFER;
+			socklen_t optlen = sizeof(rcvbuf);
+			setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+			getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen);
+			qDebug() << "UDP receive buffer:" << rcvbuf << "bytes";
+#ifdef SO_RXQ_OVFL
+			// Have the kernel report how many datagrams it dropped
+			int one = 1;
+			setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+#endif
 			return true;
 		}
 	}
@@ -29,37 +75,253 @@ bool NetSocket::bind()
 	return false;
 }
 
-void NetSocket::broadcastMsg(QByteArray *msg, QHostAddress address, int destination)
+void NetSocket::broadcastMsg(QByteArray msg, QHostAddress address, int destination)
 {	
 	// Send everywhere
 	if (destination < 0){
 		for (quint16 x = myPortMin; x <= myPortMax; x++)
-			writeDatagram(*msg, QHostAddress(QHostAddress::LocalHost), x);
-		//delete msg;
+			enqueue(msg, Peer(QHostAddress(QHostAddress::LocalHost), x));
 	}
 	// Send to specific port
 	else{
-		writeDatagram(*msg, address, destination);
-		//delete msg;
+		enqueue(msg, Peer(address, destination));
+	}
+}
+
+void NetSocket::enqueue(QByteArray msg, Peer dest)
+{
+	if (dest.first.isNull()){
+		txDropped++;
+		return;
+	}
+
+	// Few destinations, a list is cheaper than hashing
+	SendQueue *queue = NULL;
+	for (int i = 0; i < sendQueues.size(); ++i){
+		if (sendQueues.at(i)->peer == dest){
+			queue = sendQueues.at(i);
+			break;
+		}
+	}
+	if (!queue){
+		queue = new SendQueue(dest, PACE_BURST);
+		sendQueues << queue;
+	}
+
+	// Drop tail when a destination is backed up
+	if (queue->datagrams.size() >= SENDQ_MAX){
+		if (txDropped++ % 100 == 0)
+			qDebug() << "Send queue full for" << dest << "dropped" << txDropped << "so far";
+		return;
 	}
+
+	queue->datagrams.enqueue(msg);
+	txQueued++;
+	if (txQueued > txMaxQueued)
+		txMaxQueued = txQueued;
+
+	if (!flushTimer.isActive())
+		flushTimer.start(0);
+}
+
+// Sends as much of the queue as pacing allows, SEND_BATCH datagrams per
+// system call, taking one datagram per destination in turn.
+void NetSocket::flushSendQueue()
+{
+	SendQueue *owners[SEND_BATCH];
+	QByteArray datagrams[SEND_BATCH];
+
+	// Refill every bucket for the time that went by
+	qint64 now = paceClock.elapsed();
+	double refill = paceRate * (now - lastRefill) / 1000.0;
+	lastRefill = now;
+	for (int i = 0; i < sendQueues.size(); ++i)
+		sendQueues[i]->tokens = qMin(sendQueues[i]->tokens + refill, (double) PACE_BURST);
+
+	while (txQueued > 0){
+		int count = 0;
+		bool took = true;
+		while (took && count < SEND_BATCH){
+			took = false;
+			for (int i = 0; i < sendQueues.size() && count < SEND_BATCH; ++i){
+				SendQueue *queue = sendQueues[i];
+				if (queue->datagrams.isEmpty())
+					continue;
+				int size = queue->datagrams.head().size();
+				if (paceRate > 0 && queue->tokens < size)
+					continue;
+
+				queue->tokens -= size;
+				owners[count] = queue;
+				datagrams[count] = queue->datagrams.dequeue();
+				count++;
+				took = true;
+			}
+		}
+		if (count == 0)
+			break;
+
+		int done = sendBatch(owners, datagrams, count);
+		txQueued -= done;
+
+		// Put back what the kernel did not take, keeping the order
+		for (int i = count - 1; i >= done; --i){
+			owners[i]->tokens += datagrams[i].size();
+			owners[i]->datagrams.prepend(datagrams[i]);
+		}
+		if (done < count)
+			break;
+	}
+
+	// Waiting on pacing or a full socket buffer
+	if (txQueued > 0)
+		flushTimer.start(PACE_INTERVAL);
+}
+
+// Returns how many datagrams were taken off the queue (sent or dropped)
+int NetSocket::sendBatch(SendQueue **owners, QByteArray *datagrams, int count)
+{
+#ifdef Q_OS_LINUX
+	struct mmsghdr msgs[SEND_BATCH];
+	struct iovec iovs[SEND_BATCH];
+	struct sockaddr_storage addrs[SEND_BATCH];
+
+	memset(msgs, 0, sizeof(msgs));
+	memset(addrs, 0, sizeof(addrs));
+	for (int i = 0; i < count; ++i){
+		Peer dest = owners[i]->peer;
+		if (dest.first.protocol() == QAbstractSocket::IPv6Protocol){
+			struct sockaddr_in6 *in6 = (struct sockaddr_in6*) &addrs[i];
+			Q_IPV6ADDR ip = dest.first.toIPv6Address();
+			in6->sin6_family = AF_INET6;
+			in6->sin6_port = htons(dest.second);
+			memcpy(&in6->sin6_addr, &ip, sizeof(ip));
+			msgs[i].msg_hdr.msg_namelen = sizeof(*in6);
+		}
+		else{
+			struct sockaddr_in *in4 = (struct sockaddr_in*) &addrs[i];
+			in4->sin_family = AF_INET;
+			in4->sin_port = htons(dest.second);
+			in4->sin_addr.s_addr = htonl(dest.first.toIPv4Address());
+			msgs[i].msg_hdr.msg_namelen = sizeof(*in4);
+		}
+		iovs[i].iov_base = datagrams[i].data();
+		iovs[i].iov_len = datagrams[i].size();
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int n = sendmmsg(socketDescriptor(), msgs, count, MSG_DONTWAIT);
+	if (n < 0){
+		// Socket buffer is full, try again later
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+			return 0;
+		// First datagram can't be sent at all, drop it
+		txDropped++;
+		return 1;
+	}
+	txPackets += n;
+	txBatches++;
+	return n;
+#else
+	for (int i = 0; i < count; ++i){
+		if (writeDatagram(datagrams[i], owners[i]->peer.first, owners[i]->peer.second) < 0)
+			txDropped++;
+		else
+			txPackets++;
+	}
+	txBatches++;
+	return count;
+#endif
 }
 
 void NetSocket::receiveMsg()
 {
-	while (hasPendingDatagrams()) {
-		QByteArray *datagram = new QByteArray;
-        QHostAddress senderIP;
-		quint16 senderPort;
-        Peer sender;
+	QHostAddress senderIP;
+	quint16 senderPort;
+	qint64 size;
 
-        datagram->resize(pendingDatagramSize());
-        readDatagram(datagram->data(), datagram->size(), &senderIP, &senderPort);
+	// The first datagram goes through readDatagram(), which is also what
+	// re-arms Qt's read notifier for this socket
+	if (!hasPendingDatagrams())
+		return;
+	size = readDatagram(recvPool, MAX_DATAGRAM, &senderIP, &senderPort);
+	rxBatches++;
+	if (size >= 0)
+		deliver(recvPool, size, Peer(senderIP, senderPort));
 
-        sender = Peer(senderIP, senderPort);
+#if defined(Q_OS_LINUX) && defined(SO_RXQ_OVFL)
+	// Drain the rest of the queue RECV_BATCH datagrams at a time
+	struct mmsghdr msgs[RECV_BATCH];
+	struct iovec iovs[RECV_BATCH];
+	struct sockaddr_storage addrs[RECV_BATCH];
+	char control[RECV_BATCH][CMSG_SPACE(sizeof(quint32))];
 
-        emit gotNewPeer(sender);
-        emit msgReceived(datagram, sender); // Connected to ChatDailog::readNewMsg
-     }
+	while (true){
+		memset(msgs, 0, sizeof(msgs));
+		for (int i = 0; i < RECV_BATCH; ++i){
+			iovs[i].iov_base = recvPool + i * MAX_DATAGRAM;
+			iovs[i].iov_len = MAX_DATAGRAM;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+			msgs[i].msg_hdr.msg_control = control[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+		}
+
+		int n = recvmmsg(socketDescriptor(), msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+		if (n <= 0)
+			break;
+		rxBatches++;
+
+		for (int i = 0; i < n; ++i){
+			struct msghdr *hdr = &msgs[i].msg_hdr;
+
+			// Running count of datagrams the kernel had to drop
+			for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)){
+				if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL){
+					quint32 dropped;
+					memcpy(&dropped, CMSG_DATA(cmsg), sizeof(dropped));
+					if (dropped > rxDropped){
+						qDebug() << "Kernel dropped" << (dropped - rxDropped) << "datagrams";
+						rxDropped = dropped;
+					}
+				}
+			}
+
+			if (hdr->msg_flags & MSG_TRUNC){
+				rxTruncated++;
+				continue;
+			}
+
+			senderIP = QHostAddress((struct sockaddr*) &addrs[i]);
+			senderPort = ntohs(addrs[i].ss_family == AF_INET6 ?
+					((struct sockaddr_in6*) &addrs[i])->sin6_port :
+					((struct sockaddr_in*) &addrs[i])->sin_port);
+			deliver((char*) iovs[i].iov_base, msgs[i].msg_len, Peer(senderIP, senderPort));
+		}
+
+		// Queue is empty
+		if (n < RECV_BATCH)
+			break;
+	}
+#else
+	while (hasPendingDatagrams()){
+		size = readDatagram(recvPool, MAX_DATAGRAM, &senderIP, &senderPort);
+		if (size >= 0)
+			deliver(recvPool, size, Peer(senderIP, senderPort));
+	}
+#endif
+}
+
+// Hands a datagram out of the pool without copying it. It is only valid
+// until this returns, see Packet::payload.
+void NetSocket::deliver(char *data, int size, Peer sender)
+{
+	rxPackets++;
+	emit msgReceived(QByteArray::fromRawData(data, size), sender); // Connected to Node::readNewMsg
 }
 
 QList<quint16>* NetSocket::getUDPPorts()
@@ -0,0 +1,1683 @@
+#include "main.hh"
+#include "hashsum.hh"
+#include "Database.hh"
+#include <QtEndian>
+
+Node::Node()
+{
+    // Initializations
+    // Host is localhost and a 4 digit random number
+    host = QHostInfo::localHostName() + "-" + QString::number(qrand() % 10000);
+    forward = true;
+    downloadPath = QString(QDir::homePath() + "/Desktop/");
+    myHopLimit = CHATHOPLIMIT;
+    hashAlgo = HASH_DEFAULT;
+    shareInPlace = false;
+    streamServer = 0;
+    msgCounter = 1;
+    shareJobs.setMaxThreadCount(SHARE_JOBS);
+    qRegisterMetaType<ShareJob*>("ShareJob*"); // Signalled across threads
+
+    qDebug() << "Host:" << host;
+    qDebug() << "Download path:" << downloadPath;
+
+    // Database
+    db = new Database(this);
+    if (!db->openDB()){
+        qDebug() << "Failed to open database. Dying";
+        exit(1);
+    }
+    else{
+        qDebug() << "Database opened successfully.";
+        if (!(db->setUpDataTable())) exit(1);
+        if (!(db->setUpFileTable())) exit(1);
+        if (!(db->setUpDownloadTable())) exit(1);
+    }
+    connect(db, SIGNAL(blockRead(QByteArray, qint64, QByteArray)),
+            this, SLOT(serveBlock(QByteArray, qint64, QByteArray)), Qt::QueuedConnection);
+    connect(db, SIGNAL(subtreeRead(QString, QByteArray, qint64, QByteArray, int)),
+            this, SLOT(serveSubtreeBlock(QString, QByteArray, qint64, QByteArray, int)), Qt::QueuedConnection);
+
+    // Add self to status
+    addToStatus(host, 1);
+
+    // Send status to random neighbor every 2 seconds
+    connect(&statusTimer, SIGNAL(timeout()), this, SLOT(sendStatus()));
+    statusTimer.start(STATUS_PERIOD);
+
+    // Send route rumor message to random neighbor every 60 seconds
+    connect(&routeTimer, SIGNAL(timeout()), this, SLOT(sendRoute()));
+    routeTimer.start(ROUTE_PERIOD);
+
+    // Save download progress now and then, so a restart can resume
+    connect(&checkpointTimer, SIGNAL(timeout()), this, SLOT(checkpointDownloads()));
+    checkpointTimer.start(CHECKPOINT_PERIOD);
+
+    // Runs while a download has a playhead, see setPlayhead()
+    connect(&streamTimer, SIGNAL(timeout()), this, SLOT(checkDeadlines()));
+
+    // Resumed downloads wait for routes to their peers
+    if (!fileDownloads.isEmpty())
+        QTimer::singleShot(STATUS_PERIOD, this, SLOT(resumeDownloads()));
+}
+
+// Running share jobs write to the database, stop them first
+Node::~Node()
+{
+    QMap<quint32, ShareJob*>::iterator it;
+    for (it = shareQueue.begin(); it != shareQueue.end(); ++it)
+        (*it)->cancel();
+    shareJobs.waitForDone();
+    qDeleteAll(shareQueue);
+
+    checkpointDownloads(true);
+}
+
+// #### SHARED FILE FUNCTIONS ####
+
+void Node::setShareInPlace(bool set)
+{
+    shareInPlace = set;
+}
+
+// At most n files are hashed at once
+void Node::setShareJobs(int n)
+{
+    shareJobs.setMaxThreadCount(qMax(1, n));
+}
+
+// Queues a share job per file. Hashing happens on the share pool, so the
+// node keeps serving meanwhile; each file is published when its job is done.
+void Node::shareFiles(QStringList files)
+{
+    for(int i = 0; i < files.size(); ++i){
+        QFile file(files.at(i));
+        if (!file.open(QIODevice::ReadOnly)){
+            qDebug() << "Error reading file" << files.at(i);
+            continue;
+        }
+        file.close();
+
+        // Blocks go to the file's pack as the tree is built
+        ShareJob *job = new ShareJob(db, files.at(i), db->reserveFileId(), hashAlgo, shareInPlace);
+        connect(job, SIGNAL(progress(ShareJob*, quint64)), this, SIGNAL(shareProgress(ShareJob*, quint64)), Qt::QueuedConnection);
+        connect(job, SIGNAL(finished(ShareJob*)), this, SLOT(finishShare(ShareJob*)), Qt::QueuedConnection);
+
+        shareQueue.insert(job->fileId, job);
+        emit shareStarted(job);
+        shareJobs.start(job);
+    }
+}
+
+// Stops a share job. Whatever it already stored is dropped when it finishes.
+void Node::cancelShare(quint32 id)
+{
+    ShareJob *job = shareQueue.value(id);
+    if (job)
+        job->cancel();
+}
+
+// Puts the file of a finished job in the database and publishes it, or
+// drops its pack if it failed or was canceled
+void Node::finishShare(ShareJob *job)
+{
+    shareQueue.remove(job->fileId);
+    emit shareFinished(job);
+
+    if (!job->ok || !db->insertFile(job->fileId, job->name, job->size, job->hashHead, job->hashAlgo,
+                                    job->inPlace ? job->filePath : QString(), job->mtime)){
+        if (job->isCanceled())
+            qDebug() << "Canceled sharing" << job->filePath;
+        else
+            qDebug() << "Failed to share" << job->filePath;
+        db->deleteFile(job->fileId);
+        job->deleteLater();
+        return;
+    }
+
+    SharedFile *sharedFile = new SharedFile(job->name, job->size, job->hashHead, job->fileId, job->hashAlgo);
+    job->deleteLater();
+
+    // Put on list
+    sharedFiles.insert(sharedFile->id, sharedFile);
+    emit fileShared(sharedFile);
+}
+
+// Stops sharing a file and removes it from the database
+void Node::deleteSharedFile(quint32 id)
+{
+    SharedFile *sharedFile = sharedFiles.take(id);
+    if (!sharedFile)
+        return;
+
+    db->deleteFile(id);
+    delete sharedFile;
+}
+
+// Loads files already in DB at startup
+void Node::loadSharedFromDB(QString fileName, quint64 size, QByteArray hashHead, quint32 id, quint8 hashAlgo)
+{
+    SharedFile *sharedFile = new SharedFile(fileName, size, hashHead, id, hashAlgo);
+    sharedFiles.insert(sharedFile->id, sharedFile);
+    emit fileShared(sharedFile);
+}
+
+bool Node::startStreaming(quint16 port)
+{
+    if (!streamServer)
+        streamServer = new StreamServer(this);
+    return streamServer->listen(port);
+}
+
+// #### DOWNLOAD FUNCTIONS ####
+
+void Node::startFileDownload(QString fileName, quint64 size, QByteArray hashHead, quint8 hashAlgo, QList<QString> peers)
+{
+    if (!isKnownHash(hashAlgo)){
+        qDebug() << "Can't download" << fileName << "unknown hash algorithm" << hashAlgo;
+        return;
+    }
+
+    FileDownload *download = new FileDownload(fileName, downloadPath, size, hashHead, hashAlgo, db->reserveFileId(), peers);
+
+    if (!QDir("downloadPath").exists())
+        QDir().mkdir("downloadPath");
+
+    // Create file on disk, allocate its size
+    if (!download->writer.open(downloadPath + download->fileName, size, BLOCKSIZE)){
+        delete download;
+        return;
+    }
+    // Blocks are served from it as they come in, see seedBlock()
+    db->setSource(download->fileId, downloadPath + download->fileName, size, SOURCE_GROWING);
+    fileDownloads.insert(hashHead, download);
+    connect(download, SIGNAL(synced(FileDownload*)), this, SLOT(saveCheckpoint(FileDownload*)));
+
+    emit downloadStarted(download);
+    checkpoint(download);
+    if (streamServer)
+        qDebug() << "Streaming" << fileName << "at" << streamServer->url(download);
+
+    // Request the top of the merkle tree from random peer
+    QString peer = download->peers.at(qrand() % download->peers.size());
+    requestSubtree(download, peer, BlockQueue::head(), hashHead);
+}
+
+// Picks up a download checkpointed by an earlier run. Blocks in its bitmap
+// were verified before they were written, so they are trusted as they are
+// on disk, and keep being served from its pack. If the file is gone, it
+// starts over with an empty pack.
+void Node::resumeDownload(QString fileName, QString path, quint64 size, QByteArray hashHead, quint8 hashAlgo,
+                          quint32 fileId, QStringList peers, QByteArray fileMap, QByteArray frontier)
+{
+    if (!isKnownHash(hashAlgo) || peers.isEmpty() || fileDownloads.contains(hashHead))
+        return;
+
+    FileDownload *download = new FileDownload(fileName, path, size, hashHead, hashAlgo, fileId, peers);
+    QFileInfo fileInfo(path + fileName);
+    if (!fileInfo.exists() || (quint64) fileInfo.size() != size || !download->restore(fileMap, frontier)){
+        qDebug() << "Restarting download of" << fileName;
+        delete download;
+        db->deleteFile(fileId);
+        download = new FileDownload(fileName, path, size, hashHead, hashAlgo, fileId, peers);
+    }
+    if (!download->writer.open(path + fileName, size, BLOCKSIZE)){
+        delete download;
+        return;
+    }
+    db->setSource(fileId, path + fileName, size, SOURCE_GROWING);
+
+    // Finished just before the last checkpoint
+    if (download->isComplete()){
+        if (promoteDownload(download))
+            db->deleteDownload(hashHead);
+        delete download;
+        return;
+    }
+    // Never got past the head
+    if (download->blockQ.isEmpty())
+        download->blockQ.insert(BlockQueue::head(), hashHead);
+
+    qDebug() << "Resuming download of" << fileName << download->received
+             << "of" << download->fileMap.size() << "blocks done";
+    fileDownloads.insert(hashHead, download);
+    connect(download, SIGNAL(synced(FileDownload*)), this, SLOT(saveCheckpoint(FileDownload*)));
+    emit downloadStarted(download);
+    emit downloadProgress(download, download->received);
+}
+
+void Node::resumeDownloads()
+{
+    QMap<QByteArray, FileDownload*>::iterator it;
+    for (it = fileDownloads.begin(); it != fileDownloads.end(); ++it)
+        employPeers(*it);
+}
+
+// A writer that was closed returns an empty future, that counts as failed
+static bool syncSucceeded(const QFuture<bool> &future)
+{
+    return future.resultCount() > 0 && future.result();
+}
+
+static QList<quint64> leafIndexes(const QList<QPair<quint64, QByteArray> > &leaves)
+{
+    QList<quint64> idxs;
+    for (int i = 0; i < leaves.size(); ++i)
+        idxs << leaves.at(i).first;
+    return idxs;
+}
+
+// A checkpoint must not claim blocks that could still be lost, so its
+// state is taken when the writer flushes and only saved once the file is
+// synced, which happens off the event loop. With wait set (at exit) it all
+// happens right away.
+void Node::checkpoint(FileDownload* download, bool wait)
+{
+    if (download->syncWatcher.isRunning()){
+        if (!wait)
+            return;
+        download->syncWatcher.waitForFinished();
+    }
+
+    download->writer.flush();
+    dropUnwritten(download, download->writer.takeFailed());
+    download->checkpointMap = download->savedFileMap();
+    download->checkpointFrontier = download->savedFrontier();
+    download->checkpointLeaves += download->unsynced;
+    download->unsynced.clear();
+    download->dirty = false;
+
+    if (wait){
+        QFuture<bool> synced = download->writer.sync();
+        synced.waitForFinished();
+        commitCheckpoint(download, syncSucceeded(synced));
+    }
+    else{
+        download->syncWatcher.setFuture(download->writer.sync());
+    }
+}
+
+void Node::saveCheckpoint(FileDownload* download)
+{
+    commitCheckpoint(download, syncSucceeded(download->syncWatcher.future()));
+}
+
+// A failed sync may have lost any leaf written since the last checkpoint,
+// so those are fetched again and this checkpoint is not saved
+void Node::commitCheckpoint(FileDownload* download, bool synced)
+{
+    if (!synced){
+        qDebug() << "Sync failed for" << download->fileName;
+        dropUnwritten(download, leafIndexes(download->checkpointLeaves));
+        return;
+    }
+
+    // Synced leaves can be read back from the file from now on
+    publishLeaves(download, download->checkpointLeaves);
+    download->checkpointLeaves.clear();
+    db->execDataInserts();
+
+    if (!db->saveDownload(download->hashHead, download->fileName, download->path, download->size, download->hashAlgo,
+                          download->fileId, download->peers, download->checkpointMap, download->checkpointFrontier))
+        download->dirty = true;
+}
+
+void Node::checkpointDownloads(bool wait)
+{
+    QMap<QByteArray, FileDownload*>::iterator it;
+    for (it = fileDownloads.begin(); it != fileDownloads.end(); ++it){
+        if ((*it)->dirty)
+            checkpoint(*it, wait);
+    }
+}
+
+// With batch set, the hash is added to it instead of being sent right away
+BlockRequest* Node::makeBlockRequest(FileDownload* download, QString dest, quint64 position, QByteArray blockHash,
+                                     QList<QByteArray> *batch)
+{
+    PeerWindow &window = download->windows[dest];
+    BlockRequest *newReq = new BlockRequest(download, blockHash, dest, position, window.rto);
+    newReq->seq = window.onSend();
+    newReq->retry = download->retried.contains(blockHash);
+    download->pendingReqs.insert(blockHash, newReq);
+    hashToFile.insert(blockHash, download);
+    connect(newReq, SIGNAL(timeout(BlockRequest*, FileDownload*)),
+            this, SLOT(requestTimeout(BlockRequest*, FileDownload*)));
+
+    if (batch)
+        *batch << blockHash;
+    else
+        sendBlockRequest(Peer(), newReq->source, host, myHopLimit, QList<QByteArray>() << blockHash);
+    newReq->sent.start();
+    newReq->timer.start();
+    return newReq;
+}
+
+// Asks for a metadata block and the metadata below it, down to
+// SUBTREE_DEPTH levels, in one request. See enqueueMetadata().
+void Node::requestSubtree(FileDownload* download, QString dest, quint64 position, QByteArray blockHash)
+{
+    QList<QByteArray> batch;
+    makeBlockRequest(download, dest, position, blockHash, &batch);
+    sendBlockRequest(Peer(), dest, host, myHopLimit, batch, SUBTREE_DEPTH);
+}
+
+bool Node::requestNth(QString dest, FileDownload *download, quint32 n){
+    quint64 position;
+    QByteArray next;
+    if (!download->blockQ.takeNth(n, position, next))
+        return false;
+
+    makeBlockRequest(download, dest, position, next);
+    return true;
+}
+
+// Requests blocks from dest until its window (or limit) is full, up to
+// REQUEST_BATCH hashes per packet. Replies free the window one slot at a
+// time, so a peer with most of its window still out waits until a quarter
+// of it is free; the queue's next blocks then go out in one request.
+void Node::fillWindow(QString dest, FileDownload *download, int limit)
+{
+    PeerWindow &window = download->windows[dest];
+    int batchMin = qBound(1, qMin((int) window.size, limit) / 4, REQUEST_BATCH);
+    if (window.room(limit) < batchMin && download->blockQ.size() >= batchMin)
+        return;
+
+    QList<QByteArray> batch;
+    quint64 position;
+    QByteArray next;
+    while (window.canSend(limit) && takeNext(download, position, next)){
+        if (position == BlockQueue::head()){
+            requestSubtree(download, dest, position, next);
+            continue;
+        }
+        makeBlockRequest(download, dest, position, next, &batch);
+        if (batch.size() == REQUEST_BATCH){
+            sendBlockRequest(Peer(), dest, host, myHopLimit, batch);
+            batch.clear();
+        }
+    }
+    if (!batch.isEmpty())
+        sendBlockRequest(Peer(), dest, host, myHopLimit, batch);
+}
+
+// Next block to ask for: the first in pre-order, or while a stream is
+// waiting, the first from its playhead on (wrapping around at the end)
+bool Node::takeNext(FileDownload *download, quint64 &position, QByteArray &hash)
+{
+    if (download->playhead >= 0 && download->leafLevel > 0){
+        quint64 target = download->blockQ.leafPosition(download->playhead, download->leafLevel);
+        if (download->blockQ.takeFrom(target, position, hash))
+            return true;
+    }
+    return download->blockQ.takeNth(0, position, hash);
+}
+
+// Stops asking peer for blocks of this download, and puts what it still
+// owes back in the queue for the others
+void Node::quarantinePeer(FileDownload *download, QString peer)
+{
+    qDebug() << "Quarantining" << peer << "for" << download->fileName << ": bad blocks";
+    QMultiHash<QByteArray, BlockRequest*>::iterator it = download->pendingReqs.begin();
+    while (it != download->pendingReqs.end()){
+        BlockRequest *req = *it;
+        if (req->source == peer){
+            it = download->pendingReqs.erase(it);
+            if (!download->pendingReqs.contains(req->hash))
+                download->blockQ.insert(req->position, req->hash);
+            delete req;
+        }
+        else{
+            ++it;
+        }
+    }
+    download->windows[peer].inFlight = 0;
+}
+
+// Slot to timeout requests. Connected to timer in BlockRequest object.
+void Node::requestTimeout(BlockRequest *req, FileDownload *download)
+{
+    qDebug() << "Req timed out" << req->hash.toHex();
+    download->pendingReqs.remove(req->hash, req);
+    // In endgame another peer may still come through
+    if (!download->pendingReqs.contains(req->hash))
+        download->blockQ.insert(req->position, req->hash);
+    download->retried.insert(req->hash);
+    download->windows[req->source].onLoss(req->seq);
+
+    // To delayed peers, ask for the fifth in queue
+    if (download->windows[req->source].canSend() && !download->windows[req->source].quarantined)
+        requestNth(req->source, download, TIMEOUT_NEXT);
+    delete req;
+
+    // Idle peers pick up the block, or join in if it's the endgame
+    employPeers(download);
+    endgame(download);
+}
+
+// Endgame: the queue is empty and only a few blocks are still out, likely
+// with slow peers. Each of them is also asked from idle peers, up to
+// ENDGAME_COPIES at once; the first good reply wins and the other
+// requests are dropped (see handleBlockReply).
+void Node::endgame(FileDownload *download)
+{
+    QList<QByteArray> hashes = download->pendingReqs.uniqueKeys();
+    if (!download->blockQ.isEmpty() || hashes.isEmpty() || hashes.size() > ENDGAME_PENDING)
+        return;
+
+    for (int h = 0; h < hashes.size(); ++h){
+        QList<BlockRequest*> reqs = download->pendingReqs.values(hashes.at(h));
+        QStringList asked;
+        for (int r = 0; r < reqs.size(); ++r)
+            asked << reqs.at(r)->source;
+
+        for (int i = 0; i < download->peers.size() && asked.size() < ENDGAME_COPIES; ++i){
+            QString peer = download->peers.at(i);
+            const PeerWindow &window = download->windows[peer];
+            if (asked.contains(peer) || window.quarantined || !window.canSend())
+                continue;
+            // Replies to duplicates can't be told apart, so no RTT sample
+            download->retried.insert(hashes.at(h));
+            makeBlockRequest(download, peer, reqs.first()->position, hashes.at(h));
+            asked << peer;
+        }
+    }
+}
+
+// The request a reply answers: the one sent to its origin if there is one
+BlockRequest* Node::takeRequest(FileDownload *download, QByteArray hash, QString origin)
+{
+    QList<BlockRequest*> reqs = download->pendingReqs.values(hash);
+    if (reqs.isEmpty())
+        return 0;
+
+    BlockRequest *req = reqs.first();
+    for (int i = 0; i < reqs.size(); ++i){
+        if (reqs.at(i)->source == origin)
+            req = reqs.at(i);
+    }
+    download->pendingReqs.remove(hash, req);
+    return req;
+}
+
+// The first following children are already on their way from origin, as
+// part of a subtree reply, so they get requests without sending any. They
+// are checked against this block like any other reply, and time out like
+// any other request if they don't show up.
+void Node::enqueueMetadata(FileDownload* download, BlockRequest* req, QByteArray blockData, QString origin, int following)
+{
+    int hashSize = digestSize(download->hashAlgo);
+    QList<QByteArray> unsent;
+
+    // Put contents in blockQ, each child right after its parent in pre-order
+    for (int i = 0; (i * hashSize) < blockData.size(); ++i){
+        quint64 position;
+        if (!download->blockQ.child(req->position, i, position)){
+            qDebug() << "Merkle tree of" << download->fileName << "is too deep";
+            return;
+        }
+        if (i < following){
+            // Sent with no request of its own, so no RTT sample
+            makeBlockRequest(download, origin, position, blockData.mid(i * hashSize, hashSize), &unsent)->retry = true;
+        }
+        else{
+            download->blockQ.insert(position, blockData.mid(i * hashSize, hashSize));
+        }
+    }
+    download->dirty = true;
+}
+
+// Tops up every peer's window, fastest first so they get the earliest
+// blocks. Peers much slower than the fastest keep only SLOW_WINDOW
+// requests out; quarantined ones get nothing. Peers not measured yet get
+// their full window, to find out how fast they are.
+//
+// Once every peer is quarantined, the ones with the fewest bad blocks are
+// let back in rather than stalling the download. Their next bad block
+// quarantines them again.
+void Node::employPeers(FileDownload* download)
+{
+    QMultiMap<double, QString> byRate;
+    quint32 fewestBad = 0;
+    for (int i = 0; i < download->peers.size(); ++i){
+        const PeerWindow &window = download->windows[download->peers.at(i)];
+        if (!window.quarantined)
+            byRate.insert(window.rate(), download->peers.at(i));
+        if (i == 0 || window.bad < fewestBad)
+            fewestBad = window.bad;
+    }
+    if (byRate.isEmpty() && !download->peers.isEmpty() && !download->blockQ.isEmpty()){
+        qDebug() << "All peers of" << download->fileName << "sent bad blocks, retrying those with" << fewestBad << "bad blocks";
+        for (int i = 0; i < download->peers.size(); ++i){
+            PeerWindow &window = download->windows[download->peers.at(i)];
+            if (window.bad == fewestBad){
+                window.quarantined = false;
+                byRate.insert(window.rate(), download->peers.at(i));
+            }
+        }
+    }
+    if (byRate.isEmpty())
+        return;
+
+    double best = (byRate.end() - 1).key();
+    QMultiMap<double, QString>::iterator it = byRate.end();
+    while (it != byRate.begin() && !download->blockQ.isEmpty()){
+        --it;
+        bool slow = it.key() > 0 && it.key() * SLOW_RATIO < best;
+        fillWindow(it.value(), download, slow ? SLOW_WINDOW : WINDOW_MAX);
+    }
+}
+
+// False if the block itself couldn't be written. Buffered blocks a flush
+// failed on are dropped, see dropUnwritten().
+bool Node::writeBlock(FileDownload* download, QByteArray data, quint64 idx)
+{
+    download->writer.write(idx, data);
+    QList<quint64> failed = download->writer.takeFailed();
+    dropUnwritten(download, failed);
+    return download->writer.isOpen() && !failed.contains(idx);
+}
+
+// Blocks lost to a write or sync error are not in anymore: their bits are
+// cleared and they go back in the queue, so no checkpoint claims them and
+// they are never published from the file
+void Node::dropUnwritten(FileDownload* download, const QList<quint64> &lost)
+{
+    if (lost.isEmpty())
+        return;
+    qDebug() << "Lost" << lost.size() << "blocks of" << download->fileName << "to write errors";
+
+    QSet<quint64> lostSet = lost.toSet();
+    QList<QPair<quint64, QByteArray> > *leaves[] = { &download->unsynced, &download->checkpointLeaves };
+    for (int l = 0; l < 2; ++l){
+        QList<QPair<quint64, QByteArray> >::iterator it = leaves[l]->begin();
+        while (it != leaves[l]->end()){
+            if (lostSet.contains(it->first)){
+                download->unmarkReceived(it->first);
+                download->blockQ.insert(download->blockQ.leafPosition(it->first, download->leafLevel), it->second);
+                it = leaves[l]->erase(it);
+            }
+            else{
+                ++it;
+            }
+        }
+    }
+    download->dirty = true;
+}
+
+// Makes a verified block available to other peers right away. Metadata
+// goes to the download's pack. A leaf is served from the block cache
+// until the checkpoint that syncs it, then from the file (publishLeaves()),
+// so a block still sitting in the writer is never read back from disk.
+void Node::seedBlock(FileDownload* download, QByteArray hash, QByteArray data, bool isData, quint64 idx)
+{
+    if (!isData){
+        db->insertData(download->fileId, hash, data, -1);
+        return;
+    }
+    // Out of range, or a duplicate
+    if (idx >= (quint64) download->fileMap.size() || download->fileMap.testBit(idx))
+        return;
+    db->cacheBlock(hash, idx, data);
+    download->unsynced << qMakePair(idx, hash);
+}
+
+void Node::publishLeaves(FileDownload* download, const QList<QPair<quint64, QByteArray> > &leaves)
+{
+    for (int i = 0; i < leaves.size(); ++i){
+        quint64 idx = leaves.at(i).first;
+        db->insertRef(download->fileId, leaves.at(i).second, idx, idx * BLOCKSIZE,
+                      qMin((quint64) BLOCKSIZE, download->size - idx * BLOCKSIZE));
+    }
+}
+
+// Shares a finished download in place. Every block was checked against the
+// tree on the way in and the tree is already in the pack, so nothing is
+// hashed again. If it can't be recorded, or lost blocks to write errors,
+// the download is checkpointed instead and picked up when it resumes.
+bool Node::promoteDownload(FileDownload* download)
+{
+    QString filePath = download->path + download->fileName;
+
+    // The checkpoint sync still running never gets saved, so its result
+    // counts here
+    bool synced = true;
+    if (download->syncWatcher.isRunning()){
+        download->syncWatcher.waitForFinished();
+        synced = syncSucceeded(download->syncWatcher.future());
+    }
+    QFuture<bool> lastSync = download->writer.sync();
+    lastSync.waitForFinished();
+    synced = syncSucceeded(lastSync) && synced;
+    download->writer.close();
+
+    dropUnwritten(download, download->writer.takeFailed());
+    if (!synced){
+        qDebug() << "Sync failed for" << download->fileName;
+        dropUnwritten(download, leafIndexes(download->checkpointLeaves) + leafIndexes(download->unsynced));
+    }
+    publishLeaves(download, download->checkpointLeaves);
+    publishLeaves(download, download->unsynced);
+    download->checkpointLeaves.clear();
+    download->unsynced.clear();
+
+    // Written for the last time, from now on any change makes it stale
+    qint64 mtime = QFileInfo(filePath).lastModified().toTime_t();
+    if (!download->isComplete() || !db->insertFile(download->fileId, download->fileName, download->size, download->hashHead,
+                                                   download->hashAlgo, filePath, mtime)){
+        qDebug() << "Can't share finished download" << download->fileName;
+        db->execDataInserts();
+        db->saveDownload(download->hashHead, download->fileName, download->path, download->size, download->hashAlgo,
+                         download->fileId, download->peers, download->savedFileMap(), download->savedFrontier());
+        return false;
+    }
+    db->execDataInserts();
+
+    SharedFile *sharedFile = new SharedFile(download->fileName, download->size, download->hashHead,
+                                            download->fileId, download->hashAlgo);
+    sharedFiles.insert(sharedFile->id, sharedFile);
+    emit fileShared(sharedFile);
+    return true;
+}
+
+// Marks block idx as received and reports how many blocks are in
+void Node::updateProgress(FileDownload* download, quint64 idx)
+{
+    if (!download->markReceived(idx))
+        return;
+    download->dirty = true;
+    emit downloadProgress(download, download->received);
+}
+
+void Node::resolveDownload(FileDownload* download){
+    // Let front ends clear the download before it goes away
+    emit downloadFinished(download);
+
+    fileDownloads.remove(download->hashHead);
+    if (promoteDownload(download))
+        db->deleteDownload(download->hashHead);
+    QMap<QByteArray, FileDownload*>::iterator it = hashToFile.begin();
+    while (it != hashToFile.end()){
+        if (*it == download)
+            it = hashToFile.erase(it);
+        else
+            ++it;
+    }
+    delete download;
+}
+
+// #### STREAMING FUNCTIONS ####
+
+// Called by the stream server with the block a player waits on, -1 when
+// none does anymore. From then on the queue is taken from the playhead on
+// (see takeNext()) and blocks near it have deadlines (see checkDeadlines()).
+// A seek just moves the playhead, so it takes effect with the next request.
+void Node::setPlayhead(FileDownload *download, qint64 idx)
+{
+    if (download->playhead == idx)
+        return;
+    download->playhead = idx;
+    if (idx < 0)
+        return;
+
+    requestUrgent(download);
+    employPeers(download);
+    if (!streamTimer.isActive())
+        streamTimer.start(STREAM_TICK);
+}
+
+// Blocks that are in, whether or not they were written yet
+bool Node::readBlock(FileDownload *download, quint64 idx, QByteArray &data)
+{
+    if (idx >= (quint64) download->fileMap.size() || !download->fileMap.testBit(idx))
+        return false;
+    return download->writer.read(idx, qMin((quint64) BLOCKSIZE, download->size - idx * BLOCKSIZE), data);
+}
+
+// The STREAM_URGENT leaves from the playhead on, and the metadata above them
+bool Node::isUrgent(FileDownload *download, quint64 position)
+{
+    if (download->playhead < 0 || download->leafLevel <= 0)
+        return false;
+
+    quint64 last = qMin((quint64) download->playhead + STREAM_URGENT, (quint64) download->fileMap.size()) - 1;
+    quint64 first = download->blockQ.leafPosition(download->playhead, download->leafLevel);
+    return (position >= first && position <= download->blockQ.leafPosition(last, download->leafLevel))
+        || download->blockQ.covers(position, first);
+}
+
+// Peer with the best rate so far, not quarantined
+QString Node::fastestPeer(FileDownload *download, QString except)
+{
+    QString best;
+    double bestRate = -1;
+    for (int i = 0; i < download->peers.size(); ++i){
+        const PeerWindow &window = download->windows[download->peers.at(i)];
+        if (download->peers.at(i) == except || window.quarantined || window.rate() <= bestRate)
+            continue;
+        best = download->peers.at(i);
+        bestRate = window.rate();
+    }
+    return best;
+}
+
+// Right after a seek the windows are still full of requests from before
+// it, so queued urgent blocks go to the fastest peer at once, past its
+// window
+void Node::requestUrgent(FileDownload *download)
+{
+    if (download->playhead < 0 || download->leafLevel <= 0)
+        return;
+    QString peer = fastestPeer(download);
+    if (peer.isEmpty())
+        return;
+
+    quint64 target = download->blockQ.leafPosition(download->playhead, download->leafLevel);
+    QList<QByteArray> batch;
+    quint64 position;
+    QByteArray hash;
+    while (batch.size() < REQUEST_BATCH && download->blockQ.takeFrom(target, position, hash)){
+        if (!isUrgent(download, position)){
+            download->blockQ.insert(position, hash);
+            break;
+        }
+        makeBlockRequest(download, peer, position, hash, &batch);
+    }
+    if (!batch.isEmpty())
+        sendBlockRequest(Peer(), peer, host, myHopLimit, batch);
+}
+
+// Urgent blocks still queued are asked for, and urgent blocks asked for
+// more than STREAM_DEADLINE ago are asked for again from a second peer,
+// endgame style. The first reply wins.
+void Node::checkDeadlines()
+{
+    bool streaming = false;
+    QMap<QByteArray, FileDownload*>::iterator it;
+    for (it = fileDownloads.begin(); it != fileDownloads.end(); ++it){
+        FileDownload *download = *it;
+        if (download->playhead < 0)
+            continue;
+        streaming = true;
+        requestUrgent(download);
+
+        QList<BlockRequest*> late;
+        QMultiHash<QByteArray, BlockRequest*>::const_iterator r;
+        for (r = download->pendingReqs.constBegin(); r != download->pendingReqs.constEnd(); ++r){
+            if ((*r)->sent.elapsed() > STREAM_DEADLINE && download->pendingReqs.count(r.key()) == 1
+                && isUrgent(download, (*r)->position))
+                late << *r;
+        }
+        for (int i = 0; i < late.size(); ++i){
+            QString peer = fastestPeer(download, late.at(i)->source);
+            if (peer.isEmpty())
+                break;
+            // Replies to duplicates can't be told apart, so no RTT sample
+            download->retried.insert(late.at(i)->hash);
+            makeBlockRequest(download, peer, late.at(i)->position, late.at(i)->hash);
+        }
+    }
+    if (!streaming)
+        streamTimer.stop();
+}
+
+// ##### MESSAGE HANDLING FUNCTIONS #####
+
+void Node::handleBlockRequest(Peer inPeer, QString dest, QString origin, quint32 hopLimit, QList<QByteArray> blockRequest, int depth)
+{
+    // Hash list didn't parse
+    if (blockRequest.isEmpty())
+        return;
+
+    // If not for me and forwarding is on
+    if (dest != host && forward){
+        hopLimit--;
+        if (hopLimit > 0)
+            sendBlockRequest(inPeer, dest, origin, hopLimit, blockRequest, depth);
+        return;
+    }
+    // For me
+    else if (dest == host){
+        // A subtree is read and sent in one go, by serveSubtreeBlock()
+        if (depth > 0 && blockRequest.size() == 1){
+            db->getSubtreeAsync(origin, blockRequest.first(), depth);
+            return;
+        }
+
+        // Cached blocks are sent right away, anything else is read off the
+        // event loop and sent by serveBlock(), one reply per block. The
+        // blocks of one request are read together.
+        QList<QByteArray> toRead;
+        for (int i = 0; i < blockRequest.size(); ++i){
+            qint64 idx;
+            QByteArray data;
+            if (db->getCached(blockRequest.at(i), idx, data)){
+                replyWithBlock(origin, blockRequest.at(i), idx, data);
+                continue;
+            }
+
+            // Several peers asking for the same block share one read
+            QStringList &waiting = pendingServes[blockRequest.at(i)];
+            if (!waiting.contains(origin))
+                waiting << origin;
+            if (waiting.size() == 1)
+                toRead << blockRequest.at(i);
+        }
+        if (!toRead.isEmpty())
+            db->getAsync(toRead);
+    }
+}
+
+// A block read finished, reply to everyone who asked for it
+void Node::serveBlock(QByteArray hash, qint64 idx, QByteArray data)
+{
+    QStringList waiting = pendingServes.take(hash);
+    for (int i = 0; i < waiting.size(); ++i)
+        replyWithBlock(waiting.at(i), hash, idx, data);
+}
+
+void Node::serveSubtreeBlock(QString origin, QByteArray hash, qint64 idx, QByteArray data, int following)
+{
+    replyWithBlock(origin, hash, idx, data, following);
+}
+
+void Node::replyWithBlock(QString origin, QByteArray hash, qint64 idx, QByteArray data, int following)
+{
+    // Do nothing if don't have the requested block
+    if (idx == DB_NOT_FOUND)
+        return;
+
+    bool isData = (idx >= 0);
+
+    // Uncomment to simulate network behavior
+    //usleep(qrand() % 10000); // Send delay
+    //if ((qrand() % 30) == 1)  // Drop 1/30 packets
+    //    return;
+
+    // Send block back if found
+    if (isData)
+        qDebug() << "Sending file block #" << idx << "to" << origin;
+    else
+        qDebug() << "Sending metadata to" << origin;
+    sendBlockReply(Peer(), origin, host, myHopLimit, hash, data, isData, idx, following);
+}
+
+void Node::handleBlockReply(QString dest, QString origin, quint32 hopLimit, QByteArray blockReply, QByteArray blockData, bool isData, quint64 idx,
+                            int following)
+{
+    // If not for me and forwarding is on
+    if (dest != host && forward){
+        hopLimit--;
+        if (hopLimit > 0)
+            sendBlockReply(Peer(), dest, origin, hopLimit, blockReply, blockData, isData, idx, following);
+        return;
+    }
+
+    // For me
+    else if (dest == host){
+        FileDownload *download = hashToFile[blockReply];
+        if (!download) return;
+        BlockRequest *req = takeRequest(download, blockReply, origin);
+        if (!req) return; // Unexpected reply, or a duplicate that lost
+
+        req->timer.stop();
+
+        QByteArray dataHash = hashsum(download->hashAlgo, blockData);
+
+        // Karn: the reply to a block asked for more than once could be to
+        // any of the requests, so it says nothing about the RTT
+        if (dataHash == blockReply){
+            if (!req->retry && origin == req->source)
+                download->windows[req->source].onRttSample(req->sent.elapsed());
+            download->retried.remove(blockReply);
+
+            // This reply won, drop endgame duplicates
+            QList<BlockRequest*> others = download->pendingReqs.values(blockReply);
+            download->pendingReqs.remove(blockReply);
+            for (int i = 0; i < others.size(); ++i){
+                download->windows[others.at(i)->source].onCancel();
+                delete others.at(i);
+            }
+        }
+
+        // If hash does not match reply
+        if (dataHash != blockReply){
+            qDebug() << "Data-reply mismatch";
+            // Put back in queue, unless another peer was asked too
+            if (!download->pendingReqs.contains(req->hash))
+                download->blockQ.insert(req->position, req->hash);
+            download->windows[req->source].onLoss(req->seq);
+            // Blame whoever sent it, which is not always who was asked
+            PeerWindow &sender = download->windows[origin];
+            if (!sender.quarantined && sender.onBadBlock())
+                quarantinePeer(download, origin);
+        }
+        else if (isData){
+            qDebug() << "Received data block #" << QString::number(idx) << "from" << origin;
+            download->windows[req->source].onReply(blockData.size());
+            download->leafLevel = BlockQueue::level(req->position);
+
+            // A block that can't be written is fetched again
+            if (writeBlock(download, blockData, idx)){
+                seedBlock(download, blockReply, blockData, true, idx);
+                updateProgress(download, idx);
+            }
+            else{
+                download->blockQ.insert(req->position, req->hash);
+            }
+
+            // With several blocks in flight the last one can come in early,
+            // so done means every block is in
+            if (download->isComplete()){
+                delete req;
+                resolveDownload(download);
+                return;
+            }
+        }
+        else /* is metadata*/ {
+            qDebug() << "Received metadata block from" << origin;
+            download->windows[req->source].onReply(blockData.size());
+            enqueueMetadata(download, req, blockData, origin, following);
+            seedBlock(download, blockReply, blockData, false, 0);
+        }
+        // Clear request
+        if (!download->pendingReqs.contains(blockReply))
+            hashToFile.remove(blockReply);
+        delete req;
+
+        // Keep every peer's window full, and idle ones busy in endgame
+        employPeers(download);
+        endgame(download);
+    }
+}
+
+void Node::handleSearchRequest(Peer inPeer, QString origin, quint32 budget, QString search)
+{
+    if (budget <= 0)
+        return;
+
+    QStringList searchList = search.split(" ");
+    QVariantList myMatchNames;
+    QVariantList myMatchIds;
+    QVariantList myMatchSizes;
+    QVariantList myMatchAlgos;
+
+    QStringList::iterator its = searchList.begin();
+    QMap<quint32, SharedFile*>::iterator itf = sharedFiles.begin();
+
+    for (; its != searchList.end(); ++its){
+        for (; itf != sharedFiles.end(); ++itf){
+            // Match found
+            if ((*itf)->name.contains(*its, Qt::CaseInsensitive)){
+                QVariant name = QVariant((*itf)->name);
+                QVariant metaHash = QVariant((*itf)->hashHead);
+                QVariant size = QVariant((*itf)->size);
+
+                myMatchNames.append(name);
+                myMatchIds.append(metaHash);
+                myMatchSizes.append(size);
+                myMatchAlgos.append(QVariant((uint) (*itf)->hashAlgo));
+            }
+        }
+    }
+    // Reply if found something in own files
+    if (!myMatchNames.isEmpty()){
+        sendSearchReply(Peer(), origin, host, myHopLimit, search, myMatchNames, myMatchIds, myMatchSizes, myMatchAlgos);
+    }
+
+    // Forward to other nodes
+    budget--;
+    // Divide budget evenly and send out
+    if (budget > 0){
+        int fullLoops;
+        int remainder;
+        fullLoops = budget / (neighbors.size());
+        remainder = budget % (neighbors.size());
+        // Iterate over neighbors
+        QList<Peer>::iterator itn = neighbors.begin();
+        for (; (fullLoops || remainder) && itn != neighbors.end(); ++itn){
+            // Skip over neighbor who sent me this request
+            if ((*itn) == inPeer)
+                continue;
+            sendSearchRequest(*itn, origin, search, fullLoops + 1);
+            remainder--;
+        }
+    }
+}
+
+void Node::handleSearchReply(Peer inPeer, QString dest, QString origin, quint32 hopLimit, QString searchReply, QVariantList matchNames, QVariantList matchIds, QVariantList matchSizes, QVariantList matchAlgos)
+{
+    if (dest != host && forward){
+        hopLimit--;
+        if (hopLimit > 0)
+            sendSearchReply(inPeer, dest, origin, hopLimit, searchReply, matchNames, matchIds, matchSizes, matchAlgos);
+        return;
+    }
+    else if (dest == host){
+        // Matching against the current search is up to the front end
+        emit searchReplyReceived(searchReply, origin, matchNames, matchIds, matchSizes, matchAlgos);
+    }
+}
+
+void Node::handleRoute(Peer inPeer, bool isNew, bool isDirect, QString origin, quint32 seqNo, QHostAddress lastIP, quint16 lastPort)
+{
+    if (isNew){
+        // Direct messages have been handled. Indirects are only added if new.
+        if (!isDirect)
+            putOnTable(origin, Peer(lastIP, lastPort));
+
+        MongMsg *msg = new MongMsg(inPeer, origin, seqNo, NULL);
+        putOnArchive(msg);
+
+        // Reply back with status
+        sendStatus(inPeer);
+
+        // Always gossip route messages
+        broadcastToAll(msg);
+    }
+    else{
+        sendStatus(inPeer);
+    }
+}
+
+void Node::handleStatus(Peer inPeer, QVariantMap hisStatus)
+{
+    // If this is a reply
+    if (isOnHold(inPeer)){
+        MongMsg *held = getFromHold(inPeer);
+
+        if (held == NULL || held->outPeer.first.isNull())
+            return;
+
+        held->stopTimer();
+
+        removeFromHold(inPeer);
+
+        bool sync;
+
+        sync = compareStatus(hisStatus, inPeer);
+        if (sync){
+            int flip = qrand() % 2;
+            if (flip){
+                monger(held);
+            }
+        }
+    }
+    // Respond to requests.
+    else {
+        compareStatus(hisStatus, inPeer);
+    }
+}
+
+// ##### MESSAGE SENDING FUNCTIONS #####
+
+void Node::sendPacket(const Packet &packet, Peer outPeer){
+    // Connected to NetSocket::broadcastMsg()
+    emit outmsgReady(packet.serialize(), outPeer.first, outPeer.second);
+}
+
+void Node::sendBlockReply(Peer inPeer, QString dest, QString origin, quint32 hopLimit, QByteArray blockReply, QByteArray blockData, bool isData, quint64 idx,
+                          int following)
+{
+    Peer outPeer;
+    Packet packet(BLOCKREPLY_PACKET);
+
+    // Get a known peer from table, if not send it to random neighbor
+    outPeer = getFromTable(dest);
+    if (outPeer.first.isNull())
+        outPeer = randomNeighbor(inPeer);
+
+//    qDebug() << "Sending block reply. Sending it to: " << outPeer.first << outPeer.second;
+//    qDebug() << "Reply is for: " + dest;
+//    qDebug() << "Reply hash is: " + blockReply.toHex();
+
+    packet.origin = origin;
+    packet.dest = dest;
+    packet.hopLimit = hopLimit;
+    packet.hash = blockReply;
+    packet.payload = blockData;
+    packet.index = idx;
+    if (isData)
+        packet.flags |= FLAG_ISDATA;
+    else if (following > 0){
+        packet.flags |= FLAG_SUBTREE;
+        packet.index = following;
+    }
+
+    sendPacket(packet, outPeer);
+}
+
+void Node::sendBlockRequest(Peer inPeer, QString dest, QString origin, quint32 hopLimit, QList<QByteArray> blockRequest,
+                            int depth){
+    Peer outPeer;
+    Packet packet(BLOCKREQUEST_PACKET);
+
+    // Get a known peer from table, if not send it to random neighbor
+    outPeer = getFromTable(dest);
+    if (outPeer.first.isNull())
+        outPeer = randomNeighbor(inPeer);
+
+//    qDebug() << "Sending block request. Sending it to: " << outPeer.first << outPeer.second;
+//    qDebug() << "Request is for: " + dest;
+//    qDebug() << "Request hashes:" << blockRequest.size();
+
+    packet.origin = origin;
+    packet.dest = dest;
+    packet.hopLimit = hopLimit;
+    packet.setHashes(blockRequest);
+    if (depth > 0){
+        packet.flags |= FLAG_SUBTREE;
+        packet.payload = QByteArray(1, (char) qMin(depth, 255));
+    }
+
+    sendPacket(packet, outPeer);
+}
+
+void Node::sendSearchReply(Peer inPeer, QString dest, QString origin, quint32 hopLimit, QString searchReply, QVariantList matchNames, QVariantList matchIds, QVariantList matchSizes, QVariantList matchAlgos)
+{
+    Peer outPeer;
+    Packet packet(SEARCHREPLY_PACKET);
+
+    // Get a known peer from table, if not send it to random neighbor
+    if (outPeer.first.isNull())
+        outPeer = randomNeighbor(inPeer);
+
+    qDebug() << "Sending search reply to: " << outPeer.first << outPeer.second;
+    qDebug() << "Reply is for: " + dest;
+    qDebug() << "Reply search term is: " + searchReply;
+
+    packet.origin = origin;
+    packet.dest = dest;
+    packet.hopLimit = hopLimit;
+    packet.setSearchReply(searchReply, matchNames, matchIds, matchSizes, matchAlgos);
+
+    sendPacket(packet, outPeer);
+}
+
+void Node::sendSearchRequest(Peer inPeer, QString origin, QString search, quint32 budget)
+{
+    Peer outPeer;
+    Packet packet(SEARCH_PACKET);
+
+    // Send to random neighbor
+    outPeer = randomNeighbor(inPeer);
+
+    //qDebug() << "Sending search request to: " << outPeer.first << outPeer.second;
+    //qDebug() << "Search is" << search;
+    //qDebug() << "Reply budget is:" << budget;
+
+    packet.origin = origin;
+    packet.index = budget;
+    packet.payload = search.toUtf8();
+
+    sendPacket(packet, outPeer);
+}
+
+void Node::sendStatus(Peer outPeer)
+{
+    Packet packet(STATUS_PACKET);
+
+    if (outPeer.first.isNull())
+        outPeer = randomNeighbor();
+
+    packet.setStatus(status);
+
+    //qDebug() << "Sending status to" << outPeer;
+    sendPacket(packet, outPeer);
+}
+
+void Node::sendRoute(Peer outPeer)
+{
+    MongMsg *route = new MongMsg(Peer(), host, msgCounter, NULL);
+    Packet packet(ROUTE_PACKET);
+
+    if (outPeer.first.isNull())
+        outPeer = randomNeighbor();
+
+    //qDebug() << "Sending route to" << outPeer;
+
+    packet.origin = host;
+    packet.index = msgCounter;
+
+    addToStatus(host, msgCounter);
+    msgCounter++;
+    putOnArchive(route);
+    //qDebug() << "Sending route to" << outPeer;
+    sendPacket(packet, outPeer);
+}
+
+void Node::serializeMsg(MongMsg *msg, Peer destination)
+{
+    Packet packet(ROUTE_PACKET);
+
+    packet.origin = msg->origin;
+    packet.index = msg->seqNo;
+    //qDebug() << "Sending message (origin, seqno)" << msg->origin << msg->seqNo;
+
+    // If I am not original sender
+    if (msg->inPeer.first.isNull()){
+        uchar lastHop[6];
+        qToBigEndian<quint32>(msg->inPeer.first.toIPv4Address(), lastHop);
+        qToBigEndian<quint16>(msg->inPeer.second, lastHop + 4);
+        packet.flags |= FLAG_LASTHOP;
+        packet.payload = QByteArray((const char*) lastHop, 6);
+    }
+
+    sendPacket(packet, destination);
+}
+
+// bytes is a view into NetSocket's receive pool, see NetSocket::msgReceived()
+void Node::readNewMsg(QByteArray bytes, Peer inPeer)
+{
+    //qDebug() << "Status: " << status;
+    Packet packet;
+
+    if (inPeer.first.isNull())
+        return;
+
+    bool isDirect = false, // Is direct route
+         isNew = false;    // Is new message (for routes)
+
+    // Drop anything that is not a packet of our protocol version
+    if (!packet.parse(bytes))
+        return;
+
+    // Make sure sender is in neighbors
+    addIfNewPeer(inPeer);
+
+    // Indirect routes
+    if (!packet.origin.isEmpty() && (packet.flags & FLAG_LASTHOP)){
+        isDirect = false;
+    }
+    // Direct routes: always put on table
+    else if (!packet.origin.isEmpty()){
+        isDirect = true;
+        putOnTable(packet.origin, inPeer);
+    }
+
+    switch (packet.type){
+        // Route message
+        case ROUTE_PACKET: {
+            //qDebug() << "Got a route message from:" << inPeer;
+            QHostAddress lastIP;
+            quint16 lastPort = 0;
+            if ((packet.flags & FLAG_LASTHOP) && packet.payload.size() >= 6){
+                const uchar *lastHop = (const uchar*) packet.payload.constData();
+                lastIP = QHostAddress(qFromBigEndian<quint32>(lastHop));
+                lastPort = qFromBigEndian<quint16>(lastHop + 4);
+            }
+            isNew = addToStatus(packet.origin, packet.index, 1);
+            handleRoute(inPeer, isNew, isDirect, packet.origin, packet.index, lastIP, lastPort);
+            break;
+        }
+
+        // Status message
+        case STATUS_PACKET:
+            // qDebug() << "Got a status message from:" << inPeer;
+            handleStatus(inPeer, packet.status());
+            break;
+
+        // Block Request
+        case BLOCKREQUEST_PACKET:
+            //qDebug() << "Got a block request from:" << inPeer.first << inPeer.second;
+            //qDebug() << "Block request is:" << packet.hash.toHex();
+            handleBlockRequest(inPeer, packet.dest, packet.origin, packet.hopLimit, packet.hashes(),
+                               (packet.flags & FLAG_SUBTREE) && !packet.payload.isEmpty() ? (quint8) packet.payload.at(0) : 0);
+            break;
+
+        // Block Reply
+        case BLOCKREPLY_PACKET:
+            //qDebug() << "Got a block reply from:" << inPeer.first << inPeer.second;
+            //qDebug() << "Block reply is:" << packet.hash.toHex();
+            handleBlockReply(packet.dest, packet.origin, packet.hopLimit, packet.hash,
+                             packet.payload, packet.flags & FLAG_ISDATA, packet.index,
+                             packet.flags & FLAG_SUBTREE ? (int) qMin(packet.index, (quint64) SUBTREE_BLOCKS) : 0);
+            break;
+
+        // Search Request
+        case SEARCH_PACKET:
+            //qDebug() << "Got a search request from:" << inPeer.first << inPeer.second;
+            handleSearchRequest(inPeer, packet.origin, packet.index, QString::fromUtf8(packet.payload));
+            break;
+
+        // Search Reply
+        case SEARCHREPLY_PACKET: {
+            //qDebug() << "Got a search reply from:" << inPeer.first << inPeer.second;
+            QString searchReply;
+            QVariantList matchNames, matchIds, matchSizes, matchAlgos;
+            if (packet.searchReply(searchReply, matchNames, matchIds, matchSizes, matchAlgos))
+                handleSearchReply(inPeer, packet.dest, packet.origin, packet.hopLimit, searchReply,
+                                  matchNames, matchIds, matchSizes, matchAlgos);
+            break;
+        }
+    }
+}
+
+// #### RUMOR MONGERING FUNCTIONS #####
+
+void Node::monger(MongMsg *msg)
+{
+    // Send to random neighbor, except origin or last peer which it was sent to
+    Peer outPeer = randomNeighbor(msg->inPeer, msg->outPeer);
+
+    // Do not send to invalid port (see randomNeighbor())
+    if (outPeer.first.isNull())
+        return;
+
+    // Remember where message was sent
+    msg->outPeer = outPeer;
+
+    serializeMsg(msg, outPeer);
+
+    msg->setTimer(MONG_TIMEOUT);
+
+    connect(msg, SIGNAL(timeout(MongMsg*)), this, SLOT(rumorTimeout(MongMsg*)));
+
+    // Add to list of people I started mongering with
+    putOnHold(msg);
+}
+
+void Node::rumorTimeout(MongMsg* msg)
+{
+    removeFromHold(msg->outPeer);
+
+    // Keep mongering if no response
+    monger(msg);
+}
+
+// Returns true if statuses are the same, returns false otherwise.
+// If has message for other, sends it. If other has message
+// send status.
+bool Node::compareStatus(QVariantMap hisStatus, Peer inPeer)
+{
+    QList<QString> myKeys = status.keys();
+    QList<QString> hisKeys = hisStatus.keys();
+
+    QList<QString>::iterator i;
+    QList<QString>::iterator j;
+
+    // Add people you just learned of to the want list
+    for (i = hisKeys.begin(); i != hisKeys.end(); ++i){
+        bool inBoth = false;
+        for (j = myKeys.begin(); j != myKeys.end(); ++j){
+            if ((*i) == (*j))
+                inBoth = true;
+        }
+        if (!inBoth)
+            addToStatus(*i, 1);
+    }
+
+    // Check if have something other node doesnt, but only if forwarding is on
+    if (forward){
+        for (i = hisKeys.begin(); i != hisKeys.end(); ++i){
+            QVariant myVar = status[*i];
+            QVariant hisVar = hisStatus[*i];
+
+            quint32 myWant = myVar.toUInt();
+            quint32 hisWant = hisVar.toUInt();
+
+            // If have message he needs, send it
+            if (!myVar.isNull() && myWant > hisWant){
+                MongMsg *nextMsg;
+
+                nextMsg = getFromArchive(*i, hisWant);
+                // This if check should not be necessary
+                if (nextMsg != NULL){
+                    serializeMsg(nextMsg, inPeer);
+                }
+                return false;
+            }
+        }
+    }
+
+    // Check if other node has something this doesn't
+    for (i = myKeys.begin(); i != myKeys.end(); ++i){
+        QVariant myVar = status[*i];
+        QVariant hisVar = hisStatus[*i];
+
+        quint32 myWant = myVar.toUInt();
+        quint32 hisWant = hisVar.toUInt();
+
+        if (!hisVar.isNull() && myWant < hisWant){
+            //qDebug() << "Sending status because want:" << *i << myWant;
+            sendStatus(inPeer);
+            return false;
+        }
+    }
+    // qDebug() << "Compared status, synchronized.";
+    return true;
+}
+
+// Returns true if the message is new (as in it is bigger than my seqNo)
+bool Node::addToStatus(QString origin, quint32 seqNo, int isMsg)
+{
+    QVariant var = status[origin];
+
+    quint32 want = var.toUInt();
+
+    if (var.isNull()){
+        //qDebug() << "Added origin " + origin + " to want for the first time want for him is:" <<  (1 + isMsg);
+        status[origin] = seqNo + isMsg;
+        // Announce new origins (except myself)
+        if (origin != host){
+            qDebug() << "Added to chat list" << origin;
+            emit newOrigin(origin);
+        }
+        return true;
+    }
+    else if (seqNo == want){
+        status[origin] = seqNo + 1;
+        // qDebug() << "Added to status" << origin << (seqNo + 1) << isMsg;
+        return true;
+    }
+    // This is not a message I have, but I need earlier ones first.
+    else if (seqNo > want){
+        return false;
+    }
+    else
+        return false;
+}
+
+void Node::broadcastToAll(MongMsg *msg)
+{
+    QList<Peer >::iterator i;
+    for (i = neighbors.begin(); i != neighbors.end(); ++i){
+        serializeMsg(msg, *i);
+    }
+}
+
+// #### NEIGHBOR HANDLING FUNCTIONS ####
+
+void Node::processNewNeigh(QString input)
+{
+    QList<QString> inputList = input.split(":");
+
+    if (inputList.size() > 2 || inputList.size() < 2){
+        qDebug() << host << "Invalid host/ip:port input";
+        return;
+    }
+
+    // First element of list should be host, second element should be port
+    bool ok = false;
+    quint16 newPort = inputList.at(1).toUShort(&ok);
+
+    // Validate port
+    if (!ok){
+        qDebug() << "Invalid port input";
+        return;
+    }
+    QHostAddress newip = QHostAddress(inputList.at(0));
+    if (newip.isNull()){ // Have to resolve
+        int hostId = QHostInfo::lookupHost(inputList.at(0), this, SLOT(resolveNeighbor(QHostInfo)));
+        Peer newPeer = Peer(newip, newPort);
+        unresolvedNeighbors[hostId] = newPeer;
+        return;
+    }
+
+    Peer newPeer = Peer(newip, newPort);
+    neighbors << newPeer;
+    qDebug() << "Added a new peer:" << newPeer.first << newPeer.second;
+}
+
+void Node::resolveNeighbor(QHostInfo hostInfo)
+{
+    // Get unresolved peer
+    int id = hostInfo.lookupId();
+    Peer unresolved = unresolvedNeighbors[id];
+
+    QList<QHostAddress> addrs = hostInfo.addresses();
+
+    if (hostInfo.error() || addrs.isEmpty()){
+        qDebug() << "Could not resolve peer.";
+        unresolvedNeighbors.remove(id);
+        return;
+    }
+
+    // Pick first IP
+    unresolved.first = hostInfo.addresses().at(0);
+
+    // Remove from unresolved and put with regular neighbors
+    unresolvedNeighbors.remove(id);
+    neighbors << unresolved;
+
+    qDebug() << "Added a new peer" << unresolved.first << unresolved.second;
+}
+
+// Add neighbors on this node (range of four ports)
+void Node::initNeighbors(QList<quint16>* ports)
+{
+    //~ qDebug() << "ports" << *ports;
+    QList<quint16>::iterator i;
+    for (i = ports->begin(); i != ports->end(); ++i){
+        Peer newPeer = Peer(QHostAddress::LocalHost, *i);
+        neighbors << newPeer;
+    }
+}
+
+Peer Node::randomNeighbor(Peer except1, Peer except2)
+{
+    Peer randomNeigh = neighbors.at(rand() % neighbors.size());
+
+    // In case the only neighbor is an exception
+    if ((neighbors.size() == 1 && ((neighbors.at(0) == except1) || (neighbors.at(0) == except2))))
+        return Peer(); // Return null
+    else if (neighbors.size() == 2 && (((neighbors.at(0) == except1) && (neighbors.at(1) == except2)) ||
+            ((neighbors.at(1) == except1) && (neighbors.at(0) == except2))))
+        return Peer(); // Return null
+
+    // Do not return the except port
+    while ((randomNeigh == except1) || (randomNeigh == except2)){
+        randomNeigh = neighbors.at(rand() % neighbors.size());
+    }
+
+    return randomNeigh;
+}
+
+// #### UTILITY FUNCTIONS ####
+
+void Node::putOnArchive(MongMsg* msg)
+{
+    //qDebug() << "Added to archive" << msg->origin << msg->seqNo << msg->chatText;
+    if (msgArchive[msg->origin].isEmpty()){
+        QMap<quint32, MongMsg*> origMap;
+        origMap[msg->seqNo] = msg;
+        msgArchive[msg->origin] = origMap;
+    }
+    else
+        msgArchive[msg->origin][msg->seqNo] = msg;
+}
+
+MongMsg* Node::getFromArchive(QString origin, quint32 seqNo)
+{
+    if (msgArchive[origin].isEmpty())
+        return NULL;
+    else
+        return msgArchive[origin][seqNo];
+}
+
+void Node::putOnTable(QString origin, Peer pair)
+{
+	routeTable.insert(origin, pair);
+}
+
+Peer Node::getFromTable(QString origin)
+{
+	if (!routeTable.contains(origin)){
+        Peer empty;
+		return empty;
+	}
+	return routeTable[origin];
+}
+
+void Node::removeFromTable(QString origin)
+{
+	routeTable.remove(origin);
+}
+
+void Node::putOnHold(MongMsg* msg)
+{
+	onHold << msg;
+}
+
+MongMsg* Node::getFromHold(Peer get)
+{
+	QList<MongMsg*>::iterator i;
+
+	for (i = onHold.begin(); i != onHold.end(); ++i){
+        if (get == (*i)->outPeer)
+			return *i;
+	}
+    return NULL;
+}
+
+void Node::removeFromHold(Peer rem)
+{
+	QList<MongMsg*>::iterator i;
+
+	for (i = onHold.begin(); i != onHold.end(); ++i){
+        if (rem == (*i)->outPeer){
+			i = onHold.erase(i);
+			break;
+		}
+	}
+}
+
+bool Node::isOnHold(Peer check)
+{
+    QList<MongMsg*>::iterator i;
+
+    for (i = onHold.begin(); i != onHold.end(); ++i){
+        if (check == (*i)->outPeer)
+            return true;
+    }
+    return false;
+}
+
+void Node::addIfNewPeer(Peer candidate)
+{
+    QList<Peer >::iterator i;
+
+	// Dont add self!
+    if (candidate.first == QHostAddress::LocalHost && candidate.second == port)
+		return;
+
+	for (i = neighbors.begin(); i != neighbors.end(); ++i){
+        if (candidate == (*i))
+			return;
+	}
+	// If not equal to anything in list
+    neighbors << candidate;
+    qDebug() << "Added new peer:" << candidate;
+}
+
+void Node::setPort(int p)
+{
+    port = p;
+    qDebug() << "UPD Port:" << port;
+}
+
+void Node::setForwarding(bool set)
+{
+	forward = set;
+}
+
@@ -0,0 +1,158 @@
+#include "Packet.hh"
+#include <QDataStream>
+#include <QtEndian>
+#include <string.h>
+
+Packet::Packet(quint8 type)
+{
+    this->type = type;
+    this->flags = 0;
+    this->hopLimit = 0;
+    this->index = 0;
+}
+
+QByteArray Packet::serialize() const
+{
+    QByteArray originBytes = origin.toUtf8().left(MAX_ID_SIZE);
+    QByteArray destBytes = dest.toUtf8().left(MAX_ID_SIZE);
+    QByteArray bytes(PACKET_HEADER_SIZE + originBytes.size() + destBytes.size() + hash.size() + payload.size(), Qt::Uninitialized);
+    uchar *header = (uchar*) bytes.data();
+    char *pos = bytes.data() + PACKET_HEADER_SIZE;
+
+    header[0] = PROTOCOL_VERSION;
+    header[1] = type;
+    header[2] = flags;
+    header[3] = hopLimit;
+    header[4] = originBytes.size();
+    header[5] = destBytes.size();
+    qToBigEndian<quint16>(hash.size(), header + 6);
+    qToBigEndian<quint64>(index, header + 8);
+
+    memcpy(pos, originBytes.constData(), originBytes.size());
+    pos += originBytes.size();
+    memcpy(pos, destBytes.constData(), destBytes.size());
+    pos += destBytes.size();
+    memcpy(pos, hash.constData(), hash.size());
+    pos += hash.size();
+    memcpy(pos, payload.constData(), payload.size());
+
+    return bytes;
+}
+
+// Returns false on malformed packets or packets from another protocol version
+bool Packet::parse(const QByteArray &bytes)
+{
+    if (bytes.size() < PACKET_HEADER_SIZE)
+        return false;
+
+    const uchar *header = (const uchar*) bytes.constData();
+    if (header[0] != PROTOCOL_VERSION)
+        return false;
+
+    int originSize = header[4];
+    int destSize = header[5];
+    int hashSize = qFromBigEndian<quint16>(header + 6);
+    int pos = PACKET_HEADER_SIZE;
+
+    if (bytes.size() < pos + originSize + destSize + hashSize)
+        return false;
+
+    type = header[1];
+    flags = header[2];
+    hopLimit = header[3];
+    index = qFromBigEndian<quint64>(header + 8);
+
+    origin = QString::fromUtf8(bytes.constData() + pos, originSize);
+    pos += originSize;
+    dest = QString::fromUtf8(bytes.constData() + pos, destSize);
+    pos += destSize;
+    hash = QByteArray(bytes.constData() + pos, hashSize);
+    pos += hashSize;
+    // Other payloads are parsed before readNewMsg() returns, see payload
+    if (type == BLOCKREPLY_PACKET)
+        payload = QByteArray(bytes.constData() + pos, bytes.size() - pos);
+    else
+        payload = QByteArray::fromRawData(bytes.constData() + pos, bytes.size() - pos);
+
+    return true;
+}
+
+void Packet::setHashes(const QList<QByteArray> &hashes)
+{
+    hash.clear();
+    for (int i = 0; i < hashes.size(); ++i)
+        hash.append(hashes.at(i));
+    index = hashes.size();
+}
+
+// Empty if the hash field doesn't split into index hashes of equal size
+QList<QByteArray> Packet::hashes() const
+{
+    QList<QByteArray> hashes;
+    if (index == 0 || index > (quint64) hash.size() || hash.size() % index != 0)
+        return hashes;
+
+    int hashSize = hash.size() / index;
+    for (int pos = 0; pos < hash.size(); pos += hashSize)
+        hashes << hash.mid(pos, hashSize);
+    return hashes;
+}
+
+// Status payload: count, then (id length, id, want) for each origin
+void Packet::setStatus(const QVariantMap &status)
+{
+    payload.clear();
+    uchar count[4];
+    qToBigEndian<quint32>(status.size(), count);
+    payload.append((const char*) count, 4);
+
+    QVariantMap::const_iterator it;
+    for (it = status.begin(); it != status.end(); ++it){
+        QByteArray id = it.key().toUtf8().left(MAX_ID_SIZE);
+        uchar want[4];
+        qToBigEndian<quint32>(it.value().toUInt(), want);
+
+        payload.append((char) id.size());
+        payload.append(id);
+        payload.append((const char*) want, 4);
+    }
+}
+
+QVariantMap Packet::status() const
+{
+    QVariantMap status;
+    const uchar *in = (const uchar*) payload.constData();
+    int size = payload.size();
+    int pos = 4;
+
+    if (size < 4)
+        return status;
+
+    quint32 count = qFromBigEndian<quint32>(in);
+    for (quint32 i = 0; i < count && pos < size; ++i){
+        int idSize = in[pos++];
+        if (pos + idSize + 4 > size)
+            break;
+        QString id = QString::fromUtf8(payload.constData() + pos, idSize);
+        pos += idSize;
+        status.insert(id, qFromBigEndian<quint32>(in + pos));
+        pos += 4;
+    }
+    return status;
+}
+
+// Search replies are rare and variable, so their payload is left to QDataStream.
+// matchAlgos holds the hash algorithm of each match's Merkle tree.
+void Packet::setSearchReply(QString searchReply, QVariantList matchNames, QVariantList matchIds, QVariantList matchSizes, QVariantList matchAlgos)
+{
+    payload.clear();
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream << searchReply << matchNames << matchIds << matchSizes << matchAlgos;
+}
+
+bool Packet::searchReply(QString &searchReply, QVariantList &matchNames, QVariantList &matchIds, QVariantList &matchSizes, QVariantList &matchAlgos) const
+{
+    QDataStream stream(payload);
+    stream >> searchReply >> matchNames >> matchIds >> matchSizes >> matchAlgos;
+    return stream.status() == QDataStream::Ok;
+}
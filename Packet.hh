@@ -0,0 +1,76 @@
+#ifndef PACKET_HH
+#define PACKET_HH
+
+#include <QByteArray>
+#include <QString>
+#include <QVariantMap>
+#include <QVariantList>
+#include <QList>
+
+#define PROTOCOL_VERSION    3
+#define PACKET_HEADER_SIZE  16  // bytes
+#define MAX_ID_SIZE         255 // bytes, origin and dest ids
+
+// Packet types, byte 1 of every header
+enum packetType {
+    ROUTE_PACKET = 1,
+    STATUS_PACKET,
+    BLOCKREQUEST_PACKET,
+    BLOCKREPLY_PACKET,
+    SEARCH_PACKET,
+    SEARCHREPLY_PACKET
+};
+
+// Header flags
+#define FLAG_ISDATA     0x01    // Block reply carries file data, not metadata
+#define FLAG_LASTHOP    0x02    // Route payload carries last hop's address
+#define FLAG_SUBTREE    0x04    // Block request: payload is a depth, the metadata below is wanted too.
+                                // Metadata reply: index is how many of its children follow.
+
+// Every packet is a fixed size header, followed by the origin id, dest id
+// and hash (their lengths are in the header) and then the raw payload.
+// All integers are big endian.
+//
+//  0       version
+//  1       type
+//  2       flags
+//  3       hop limit
+//  4       origin length
+//  5       dest length
+//  6-7     hash length
+//  8-15    index (block index, route sequence number, search budget, or
+//          hashes in a block request)
+class Packet
+{
+    public:
+        Packet(quint8 type = 0);
+
+        quint8 type;
+        quint8 flags;
+        quint8 hopLimit;
+        QString origin;
+        QString dest;
+        QByteArray hash;
+        quint64 index;
+        // After parse(), only valid while bytes is: NetSocket's receive pool
+        // is reused by the next batch. Block replies are the exception, their
+        // data outlives the call (writer, cache, store), so it is copied.
+        QByteArray payload;
+
+        QByteArray serialize() const;
+
+        bool parse(const QByteArray &bytes);
+
+        // Block requests name several hashes of one size, back to back in
+        // the hash field, with their count in the index
+        void setHashes(const QList<QByteArray> &hashes);
+        QList<QByteArray> hashes() const;
+
+        // Payload helpers for the less common packet types
+        void setStatus(const QVariantMap &status);
+        QVariantMap status() const;
+        void setSearchReply(QString searchReply, QVariantList matchNames, QVariantList matchIds, QVariantList matchSizes, QVariantList matchAlgos);
+        bool searchReply(QString &searchReply, QVariantList &matchNames, QVariantList &matchIds, QVariantList &matchSizes, QVariantList &matchAlgos) const;
+};
+
+#endif // PACKET_HH
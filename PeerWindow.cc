@@ -0,0 +1,86 @@
+#include "main.hh"
+
+PeerWindow::PeerWindow()
+{
+    this->size = WINDOW_INIT;
+    this->ssthresh = WINDOW_SSTHRESH;
+    this->inFlight = 0;
+    this->sent = 0;
+    this->recover = 0;
+    this->srtt = 0;
+    this->rttvar = 0;
+    this->rto = BLOCKTIMEOUT;
+    this->bytes = 0;
+    this->losses = 0;
+    this->bad = 0;
+    this->quarantined = false;
+}
+
+double PeerWindow::rate() const
+{
+    if (!active.isValid() || active.elapsed() <= 0)
+        return 0;
+    return bytes * 1000.0 / active.elapsed();
+}
+
+quint32 PeerWindow::onSend()
+{
+    if (!active.isValid())
+        active.start();
+    inFlight++;
+    return sent++;
+}
+
+void PeerWindow::onReply(int size)
+{
+    bytes += size;
+    inFlight = qMax(0, inFlight - 1);
+    if (this->size < ssthresh)
+        this->size += 1;
+    else
+        this->size += 1 / this->size;
+    this->size = qMin(this->size, (double) WINDOW_MAX);
+}
+
+void PeerWindow::onLoss(quint32 seq)
+{
+    losses++;
+    inFlight = qMax(0, inFlight - 1);
+    if (seq < recover)
+        return;
+    ssthresh = qMax(size / 2, (double) WINDOW_MIN);
+    size = ssthresh;
+    recover = sent;
+    rto = qMin(2 * rto, RTO_MAX);
+}
+
+// A duplicate request that lost the race: not the peer's fault
+void PeerWindow::onCancel()
+{
+    inFlight = qMax(0, inFlight - 1);
+}
+
+// A peer that keeps sending bad blocks is broken or malicious. True once
+// it is quarantined.
+bool PeerWindow::onBadBlock()
+{
+    bad++;
+    if (bad >= QUARANTINE_BAD)
+        quarantined = true;
+    return quarantined;
+}
+
+// RFC 6298: rttvar and srtt weighted 1/4 and 1/8, and a timeout of srtt
+// plus four deviations
+void PeerWindow::onRttSample(qint64 rtt)
+{
+    if (srtt == 0){
+        srtt = qMax((double) rtt, 1.0);
+        rttvar = srtt / 2;
+    }
+    else{
+        rttvar = 0.75 * rttvar + 0.25 * qAbs(srtt - rtt);
+        srtt = 0.875 * srtt + 0.125 * rtt;
+    }
+    rto = qBound(RTO_MIN, (int) (srtt + 4 * rttvar), RTO_MAX);
+}
@@ -71,7 +71,7 @@ void SearchDialog::search(){
     resultList->setRowCount(0);
 
     currentSearch = searchTerm;
-    dad->sendSearchRequest(Peer(), dad->host, searchTerm, 2);
+    dad->node->sendSearchRequest(Peer(), dad->node->host, searchTerm, 2);
     timer.start();
 }
 
@@ -81,7 +81,7 @@ void SearchDialog::expandSearch(){
     if (budget >= 100)
         timer.stop();
 
-    dad->sendSearchRequest(Peer(), dad->host, currentSearch, budget);
+    dad->node->sendSearchRequest(Peer(), dad->node->host, currentSearch, budget);
 }
 
 void SearchDialog::startDownload()
@@ -92,12 +92,12 @@ void SearchDialog::startDownload()
     // Clean up file name, in case it has directories
     QString realName = trueResult->fileName.split("/").last();
 
-    dad->startFileDownload(realName, trueResult->size, trueResult->metaHash, trueResult->peers.toList());
+    dad->node->startFileDownload(realName, trueResult->size, trueResult->metaHash, trueResult->hashAlgo, trueResult->peers.toList());
 }
 
-void SearchDialog::addResult(QString fileName, QString origin, QByteArray hash, quint64 size)
+void SearchDialog::addResult(QString fileName, QString origin, QByteArray hash, quint64 size, quint8 hashAlgo)
 {
-    SearchResult *result = new SearchResult(fileName, origin, hash, size);
+    SearchResult *result = new SearchResult(fileName, origin, hash, size, hashAlgo);
 
     QTableWidgetItem *peerCell = new QTableWidgetItem(QString::number(1));
     peerCell->setFlags(peerCell->flags() & ~((Qt::ItemIsEditable | Qt::ItemIsUserCheckable)));
@@ -108,13 +108,14 @@ void SearchDialog::addResult(QString fileName, QString origin, QByteArray hash,
     resultList->setItem(insertAt - 1, 1, peerCell);
 }
 
-SearchResult::SearchResult(QString fileName, QString peer, QByteArray metaHash, quint64 size) : QTableWidgetItem(fileName)
+SearchResult::SearchResult(QString fileName, QString peer, QByteArray metaHash, quint64 size, quint8 hashAlgo) : QTableWidgetItem(fileName)
 {
     this->peers = QSet<QString>();
     this->peers.insert(peer);
     this->fileName = fileName;
     this->metaHash = metaHash;
     this->size = size;
+    this->hashAlgo = hashAlgo;
 
     this->setFlags(this->flags() & ~(Qt::ItemIsEditable | Qt::ItemIsUserCheckable));
 }
@@ -0,0 +1,7 @@
+#include "main.hh"
+
+SendQueue::SendQueue(Peer peer, double tokens)
+{
+    this->peer = peer;
+    this->tokens = tokens;
+}
@@ -0,0 +1,170 @@
+#include "main.hh"
+#include "hashsum.hh"
+
+ShareJob::ShareJob(Database *db, QString filePath, quint32 fileId, quint8 hashAlgo, bool inPlace)
+{
+    QFileInfo fileInfo(filePath);
+
+    this->db = db;
+    this->filePath = fileInfo.absoluteFilePath();
+    this->name = fileInfo.fileName();
+    this->size = fileInfo.size();
+    // Taken before hashing, so changes made while hashing also count as stale
+    this->mtime = fileInfo.lastModified().toTime_t();
+    this->fileId = fileId;
+    this->hashAlgo = hashAlgo;
+    this->inPlace = inPlace;
+    this->ok = false;
+    this->position = 0;
+
+    // Node deletes the job once it has handled finished()
+    setAutoDelete(false);
+}
+
+// Runs on Node's share pool. Only writes blocks to the store; the file is
+// recorded and published by Node once the job is finished.
+void ShareJob::run()
+{
+    if (!isCanceled()){
+        progressClock.start();
+        hashHead = buildMerkleTree();
+        // A short read wraps the tree up early, over fewer leaves than
+        // the file has
+        ok = !isCanceled() && !hashHead.isEmpty() && position == (qint64) CEILING(size, BLOCKSIZE);
+    }
+    emit finished(this);
+}
+
+// Safe from any thread. A job that hasn't started yet does nothing when
+// its turn comes; a running one stops after its current batch of leaves.
+void ShareJob::cancel()
+{
+    canceled.fetchAndStoreOrdered(1);
+}
+
+bool ShareJob::isCanceled()
+{
+    return canceled.fetchAndAddOrdered(0) != 0;
+}
+
+// ## MERKLE TREE BUILDING FUNCTIONS ####
+
+// Fills Q0. The first queue in the merkle tree, building algorithm. Q0 is filled
+// with hashes of blocks of the shared file. The blocks are split in one chunk
+// per core and hashed in parallel; results come back in file order. Files
+// shared in place only get a reference to each block, not a copy.
+void ShareJob::fillQ0(QQueue<QByteArray> &q)
+{
+    qint64 nBlocks = CEILING(size, BLOCKSIZE);
+    qint64 count = qMin((qint64) HASHESPERBLOCK(hashAlgo), nBlocks - position);
+    if (count <= 0 || isCanceled())
+        return;
+
+    int nChunks = qMax(1, QThreadPool::globalInstance()->maxThreadCount());
+    qint64 perChunk = CEILING(count, nChunks);
+    QList<LeafChunk> chunks;
+    for (qint64 first = position; first < position + count; first += perChunk)
+        chunks << LeafChunk(filePath, first, qMin(perChunk, position + count - first), hashAlgo, !inPlace);
+
+    chunks = QtConcurrent::blockingMapped<QList<LeafChunk> >(chunks, hashLeafChunk);
+
+    for (int c = 0; c < chunks.size(); ++c){
+        const LeafChunk &chunk = chunks.at(c);
+        for (int i = 0; i < chunk.hashes.size(); ++i){
+            // Add block to database, hash is the key
+            //qDebug() << "Inserting with pos" << position;
+            if (inPlace)
+                db->insertRef(fileId, chunk.hashes.at(i), position, position * BLOCKSIZE,
+                              qMin((quint64) BLOCKSIZE, size - position * BLOCKSIZE));
+            else
+                db->insertData(fileId, chunk.hashes.at(i), chunk.blocks.at(i), position);
+            position++;
+            q.enqueue(chunk.hashes.at(i));
+        }
+        // Short read, file changed under us or can't be read
+        if (chunk.hashes.size() < chunk.count){
+            qDebug() << "Short read at block" << position << "of" << filePath;
+            break;
+        }
+    }
+
+    if (progressClock.elapsed() >= SHARE_PROGRESS){
+        progressClock.restart();
+        emit progress(this, position);
+    }
+}
+
+// Hashes an entire queue and puts the hash in higher queue.
+QByteArray ShareJob::hashQueue(QQueue<QByteArray> &q)
+{
+    QByteArray block;
+    QByteArray hash;
+
+    while(!q.isEmpty()){;
+        block.append(q.dequeue());
+    }
+    hash = hashsum(hashAlgo, block);
+
+    db->insertData(fileId, hash, block, -1);
+
+    return hash;
+}
+
+// Builds the merkle tree of a file. Important: algorithm is complicated
+// because tree must be built without loading entire file to memory.
+// Uses a queue to store hashes in each level of the tree. Once a queue hash
+// HASHESPERBLOCK element, hashQueue() is called.
+// Q0 is kept always full. Once Q0 is not full, the tree creation is wrapped up.
+// A canceled job stops refilling Q0, so it wraps up early; its head hash is
+// thrown away.
+QByteArray ShareJob::buildMerkleTree()
+{
+    // Start actual tree build
+    QVector<QQueue<QByteArray> > qs(1);
+    quint32 cur_q = 0; // Start at queue 0
+    fillQ0(qs[0]);
+
+    while (true){
+        // Go up, filling and hashing queues
+        if(qs[cur_q].size() == HASHESPERBLOCK(hashAlgo)){
+            QByteArray queueHash = hashQueue(qs[cur_q]); // Also inserts to data map
+
+            // Make sure to keep q0 filled with block hashes
+            if (cur_q == 0)
+                fillQ0(qs[0]);
+
+            // Create new level queue if needed
+            if ((quint32) (qs.size() - 1) == cur_q)
+                qs.insert(cur_q + 1, QQueue<QByteArray>());
+            qs[cur_q + 1].enqueue(queueHash);
+            cur_q++;
+        }
+        else{
+            // Go down, until a queue can be hashed (q0 can always be hashed
+            // unless, end of file is readched).
+            if (cur_q != 0){
+                --cur_q;
+                continue;
+            }
+            // When q0 is empty, ended reading file, wrap up tree.
+            else{
+                QByteArray hashHead;
+                // If currently at top queue and only in queue
+                if ((qs[cur_q].size() == 1 && (cur_q == (quint32) qs.size() - 1))){
+                    hashHead = qs[cur_q].at(0);
+                }
+                else{
+                    hashHead = hashQueue(qs[cur_q]);
+                    while ((cur_q + 1) < (quint32) qs.size()){
+                        cur_q++;
+                        qs[cur_q].enqueue(hashHead);
+                        hashHead = hashQueue(qs[cur_q]);
+                    }
+                }
+                // queueHash is the head of the Merkle tree
+                db->execDataInserts();
+                return hashHead;
+            }
+        }
+    }
+}
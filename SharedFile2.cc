@@ -1,8 +1,9 @@
 #include "main.hh"
 
-SharedFile::SharedFile(QString name, quint64 size, QByteArray hashHead, quint32 id){
+SharedFile::SharedFile(QString name, quint64 size, QByteArray hashHead, quint32 id, quint8 hashAlgo){
     this->name = name;
     this->size = size;
     this->hashHead = hashHead;
     this->id = id;
+    this->hashAlgo = hashAlgo;
 }
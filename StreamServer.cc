@@ -0,0 +1,252 @@
+#include "main.hh"
+#include <QRegExp>
+
+StreamClient::StreamClient()
+{
+    responding = false;
+    download = 0;
+    offset = 0;
+    end = 0;
+}
+
+// Players guess the format from the data, browsers need a type
+static QString contentType(QString fileName)
+{
+    QString suffix = QFileInfo(fileName).suffix().toLower();
+    if (suffix == "mp4" || suffix == "m4v")
+        return "video/mp4";
+    if (suffix == "webm")
+        return "video/webm";
+    if (suffix == "mkv")
+        return "video/x-matroska";
+    if (suffix == "ogv" || suffix == "ogg")
+        return "video/ogg";
+    if (suffix == "mp3")
+        return "audio/mpeg";
+    return "application/octet-stream";
+}
+
+StreamServer::StreamServer(Node *node) : QObject(node)
+{
+    this->node = node;
+    connect(&server, SIGNAL(newConnection()), this, SLOT(newConnection()));
+    connect(node, SIGNAL(downloadProgress(FileDownload*, quint64)), this, SLOT(downloadProgress(FileDownload*, quint64)));
+    connect(node, SIGNAL(downloadFinished(FileDownload*)), this, SLOT(downloadFinished(FileDownload*)));
+}
+
+// Loopback only, this is for a player on the same machine
+bool StreamServer::listen(quint16 port)
+{
+    if (!server.listen(QHostAddress::LocalHost, port)){
+        qDebug() << "Can't stream on port" << port << server.errorString();
+        return false;
+    }
+    qDebug() << "Streaming downloads on port" << server.serverPort();
+    return true;
+}
+
+QString StreamServer::url(FileDownload *download)
+{
+    return "http://127.0.0.1:" + QString::number(server.serverPort()) + "/" + download->hashHead.toHex();
+}
+
+void StreamServer::newConnection()
+{
+    while (server.hasPendingConnections()){
+        QTcpSocket *socket = server.nextPendingConnection();
+        clients.insert(socket, StreamClient());
+        connect(socket, SIGNAL(readyRead()), this, SLOT(readRequest()));
+        connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(sendMore()));
+        // Queued: abort() and disconnectFromHost() can signal it right away,
+        // in the middle of sendBody()
+        connect(socket, SIGNAL(disconnected()), this, SLOT(dropClient()), Qt::QueuedConnection);
+    }
+}
+
+void StreamServer::readRequest()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
+    if (!socket || !clients.contains(socket))
+        return;
+
+    StreamClient &client = clients[socket];
+    if (client.responding){
+        socket->readAll();
+        return;
+    }
+    client.request.append(socket->readAll());
+    if (client.request.contains("\r\n\r\n"))
+        respond(socket, client);
+    else if (client.request.size() > 8192)
+        socket->abort();
+}
+
+// One GET (or HEAD) per connection, with or without a Range header. The
+// connection is closed once the body is sent.
+void StreamServer::respond(QTcpSocket *socket, StreamClient &client)
+{
+    QStringList lines = QString::fromLatin1(client.request).split("\r\n");
+    QStringList requestLine = lines.first().split(' ');
+    client.responding = true;
+
+    // Downloads that finished in this run are served from their file
+    QByteArray hashHead;
+    if (requestLine.size() >= 2 && (requestLine.at(0) == "GET" || requestLine.at(0) == "HEAD"))
+        hashHead = QByteArray::fromHex(requestLine.at(1).section('/', 1, 1).toLatin1());
+    FileDownload *download = node->fileDownloads.value(hashHead);
+    QString filePath;
+    quint64 size;
+    if (download){
+        filePath = download->path + download->fileName;
+        size = download->size;
+    }
+    else if (finished.contains(hashHead)){
+        filePath = finished.value(hashHead);
+        size = QFileInfo(filePath).size();
+    }
+    else{
+        socket->write("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        socket->disconnectFromHost();
+        return;
+    }
+
+    quint64 first = 0;
+    quint64 last = size - 1;
+    bool partial = false;
+    QRegExp range("^range:\\s*bytes=(\\d*)-(\\d*)", Qt::CaseInsensitive);
+    for (int i = 1; i < lines.size(); ++i){
+        if (range.indexIn(lines.at(i)) < 0)
+            continue;
+        partial = true;
+        // bytes=-n is the last n bytes
+        if (range.cap(1).isEmpty())
+            first = size - qMin(size, range.cap(2).toULongLong());
+        else
+            first = range.cap(1).toULongLong();
+        if (!range.cap(1).isEmpty() && !range.cap(2).isEmpty())
+            last = qMin(last, range.cap(2).toULongLong());
+        break;
+    }
+    if (size == 0 || first > last || first >= size){
+        socket->write("HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */" + QByteArray::number(size)
+                      + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        socket->disconnectFromHost();
+        return;
+    }
+
+    QByteArray header;
+    header += partial ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+    header += "Content-Type: " + contentType(filePath).toLatin1() + "\r\n";
+    header += "Content-Length: " + QByteArray::number(last - first + 1) + "\r\n";
+    if (partial)
+        header += "Content-Range: bytes " + QByteArray::number(first) + "-" + QByteArray::number(last)
+                  + "/" + QByteArray::number(size) + "\r\n";
+    header += "Accept-Ranges: bytes\r\nConnection: close\r\n\r\n";
+    socket->write(header);
+
+    if (requestLine.at(0) == "HEAD"){
+        socket->disconnectFromHost();
+        return;
+    }
+
+    client.download = download;
+    client.filePath = filePath;
+    client.offset = first;
+    client.end = last + 1;
+
+    // A new request is where the player is now, seeks included
+    if (download)
+        node->setPlayhead(download, first / BLOCKSIZE);
+    sendBody(socket, client);
+}
+
+// Sends what is in from the client's offset on, keeping at most
+// STREAM_BUFFER bytes queued on the socket. Stops at the first block that
+// hasn't arrived, which becomes the playhead; downloadProgress() resumes.
+void StreamServer::sendBody(QTcpSocket *socket, StreamClient &client)
+{
+    while (client.offset < client.end && socket->bytesToWrite() < STREAM_BUFFER){
+        quint64 idx = client.offset / BLOCKSIZE;
+        QByteArray data;
+        if (!readBlock(client, idx, data)){
+            if (client.download)
+                node->setPlayhead(client.download, idx);
+            return;
+        }
+        qint64 skip = client.offset - idx * BLOCKSIZE;
+        qint64 length = qMin(data.size() - skip, (qint64) (client.end - client.offset));
+        if (length <= 0){
+            socket->abort();
+            return;
+        }
+        socket->write(data.constData() + skip, length);
+        client.offset += length;
+    }
+    if (client.offset >= client.end)
+        socket->disconnectFromHost();
+}
+
+bool StreamServer::readBlock(StreamClient &client, quint64 idx, QByteArray &data)
+{
+    if (client.download)
+        return node->readBlock(client.download, idx, data);
+
+    QFile file(client.filePath);
+    if (!file.open(QIODevice::ReadOnly) || !file.seek(idx * BLOCKSIZE))
+        return false;
+    data = file.read(BLOCKSIZE);
+    return !data.isEmpty();
+}
+
+void StreamServer::sendMore()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
+    // Only once a body is under way
+    if (socket && clients.contains(socket) && !clients[socket].filePath.isEmpty())
+        sendBody(socket, clients[socket]);
+}
+
+void StreamServer::dropClient()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
+    if (!socket)
+        return;
+    FileDownload *download = clients.take(socket).download;
+    socket->deleteLater();
+    if (download)
+        releasePlayhead(download);
+}
+
+// The playhead stays while any client still streams the download
+void StreamServer::releasePlayhead(FileDownload *download)
+{
+    QHash<QTcpSocket*, StreamClient>::const_iterator it;
+    for (it = clients.constBegin(); it != clients.constEnd(); ++it){
+        if (it->download == download)
+            return;
+    }
+    node->setPlayhead(download, -1);
+}
+
+void StreamServer::downloadProgress(FileDownload *download, quint64 nBlocks)
+{
+    Q_UNUSED(nBlocks);
+    QHash<QTcpSocket*, StreamClient>::iterator it;
+    for (it = clients.begin(); it != clients.end(); ++it){
+        if (it->download == download)
+            sendBody(it.key(), *it);
+    }
+}
+
+// Blocks are read from the file from now on. Node flushes it before the
+// event loop gets back to any client.
+void StreamServer::downloadFinished(FileDownload *download)
+{
+    finished.insert(download->hashHead, download->path + download->fileName);
+
+    QHash<QTcpSocket*, StreamClient>::iterator it;
+    for (it = clients.begin(); it != clients.end(); ++it){
+        if (it->download == download)
+            it->download = 0;
+    }
+}
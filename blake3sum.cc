@@ -0,0 +1,425 @@
+#include "blake3sum.hh"
+#include <string.h>
+
+// BLAKE3 in tree, 32 byte output only (no keyed or derive-key modes). Input
+// is split in 1 KiB chunks that hash independently, so on x86-64 whole
+// chunks are compressed eight at a time in AVX2 lanes, or four at a time in
+// SSE2 lanes. Parents and the last chunk go through the portable
+// compression function.
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BLAKE3_X86
+#include <immintrin.h>
+#endif
+
+#define BLAKE3_BLOCK    64      // bytes
+#define BLAKE3_CHUNK    1024    // bytes
+#define BLAKE3_MAXDEPTH 54      // Chunk CV stack, enough for 2^64 bytes
+
+// Domain flags
+#define CHUNK_START     0x01
+#define CHUNK_END       0x02
+#define PARENT          0x04
+#define ROOT            0x08
+
+static const quint32 blake3IV[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+                                    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+
+// Message word order for each of the seven rounds
+static const int schedule[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13}
+};
+
+static inline quint32 ror(quint32 x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static inline quint32 loadLE32(const uchar *p)
+{
+    return p[0] | ((quint32) p[1] << 8) | ((quint32) p[2] << 16) | ((quint32) p[3] << 24);
+}
+
+static inline void storeLE32(uchar *p, quint32 v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline void g(quint32 *s, int a, int b, int c, int d, quint32 mx, quint32 my)
+{
+    s[a] += s[b] + mx;
+    s[d] = ror(s[d] ^ s[a], 16);
+    s[c] += s[d];
+    s[b] = ror(s[b] ^ s[c], 12);
+    s[a] += s[b] + my;
+    s[d] = ror(s[d] ^ s[a], 8);
+    s[c] += s[d];
+    s[b] = ror(s[b] ^ s[c], 7);
+}
+
+// Compresses one 64 byte block into cv. Only the first half of the output is
+// kept, which is all a 32 byte digest needs.
+static void compress(quint32 cv[8], const uchar *block, quint64 counter, quint32 blockLen, quint32 flags)
+{
+    quint32 m[16], s[16];
+
+    for (int i = 0; i < 16; ++i)
+        m[i] = loadLE32(block + 4 * i);
+
+    memcpy(s, cv, 8 * sizeof(quint32));
+    memcpy(s + 8, blake3IV, 4 * sizeof(quint32));
+    s[12] = counter;
+    s[13] = counter >> 32;
+    s[14] = blockLen;
+    s[15] = flags;
+
+    for (int r = 0; r < 7; ++r){
+        const int *w = schedule[r];
+        g(s, 0, 4, 8, 12, m[w[0]], m[w[1]]);
+        g(s, 1, 5, 9, 13, m[w[2]], m[w[3]]);
+        g(s, 2, 6, 10, 14, m[w[4]], m[w[5]]);
+        g(s, 3, 7, 11, 15, m[w[6]], m[w[7]]);
+        g(s, 0, 5, 10, 15, m[w[8]], m[w[9]]);
+        g(s, 1, 6, 11, 12, m[w[10]], m[w[11]]);
+        g(s, 2, 7, 8, 13, m[w[12]], m[w[13]]);
+        g(s, 3, 4, 9, 14, m[w[14]], m[w[15]]);
+    }
+
+    for (int i = 0; i < 8; ++i)
+        cv[i] = s[i] ^ s[i + 8];
+}
+
+// Chaining value of one chunk of up to BLAKE3_CHUNK bytes. An empty chunk is
+// still one (empty) block.
+static void chunkCV(const uchar *data, int size, quint64 counter, quint32 extraFlags, quint32 cv[8])
+{
+    int nBlocks = (size == 0) ? 1 : (size + BLAKE3_BLOCK - 1) / BLAKE3_BLOCK;
+
+    memcpy(cv, blake3IV, sizeof(blake3IV));
+    for (int blk = 0; blk < nBlocks; ++blk){
+        int blockLen = qMin(BLAKE3_BLOCK, size - blk * BLAKE3_BLOCK);
+        quint32 flags = (blk == 0 ? CHUNK_START : 0);
+        if (blk == nBlocks - 1)
+            flags |= CHUNK_END | extraFlags;
+
+        if (blockLen == BLAKE3_BLOCK){
+            compress(cv, data + blk * BLAKE3_BLOCK, counter, blockLen, flags);
+        }
+        else{
+            uchar last[BLAKE3_BLOCK];
+            memset(last, 0, sizeof(last));
+            memcpy(last, data + blk * BLAKE3_BLOCK, blockLen);
+            compress(cv, last, counter, blockLen, flags);
+        }
+    }
+}
+
+static void parentCV(const quint32 left[8], const quint32 right[8], quint32 flags, quint32 cv[8])
+{
+    uchar block[BLAKE3_BLOCK];
+    for (int i = 0; i < 8; ++i){
+        storeLE32(block + 4 * i, left[i]);
+        storeLE32(block + 32 + 4 * i, right[i]);
+    }
+    memcpy(cv, blake3IV, sizeof(blake3IV));
+    compress(cv, block, 0, BLAKE3_BLOCK, flags | PARENT);
+}
+
+#ifdef BLAKE3_X86
+
+// Both SIMD kernels hash whole chunks with consecutive counters, one chunk
+// per 32-bit lane. Message words are loaded a block at a time and
+// transposed so that vector i holds word i of every lane.
+
+#define ROR4(x, n) _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - (n)))
+
+#define G4(a, b, c, d, mx, my)                                      \
+    a = _mm_add_epi32(_mm_add_epi32(a, b), mx);                     \
+    d = ROR4(_mm_xor_si128(d, a), 16);                              \
+    c = _mm_add_epi32(c, d);                                        \
+    b = ROR4(_mm_xor_si128(b, c), 12);                              \
+    a = _mm_add_epi32(_mm_add_epi32(a, b), my);                     \
+    d = ROR4(_mm_xor_si128(d, a), 8);                               \
+    c = _mm_add_epi32(c, d);                                        \
+    b = ROR4(_mm_xor_si128(b, c), 7);
+
+static inline void transpose4(__m128i v[4])
+{
+    __m128i t0 = _mm_unpacklo_epi32(v[0], v[1]);
+    __m128i t1 = _mm_unpacklo_epi32(v[2], v[3]);
+    __m128i t2 = _mm_unpackhi_epi32(v[0], v[1]);
+    __m128i t3 = _mm_unpackhi_epi32(v[2], v[3]);
+    v[0] = _mm_unpacklo_epi64(t0, t1);
+    v[1] = _mm_unpackhi_epi64(t0, t1);
+    v[2] = _mm_unpacklo_epi64(t2, t3);
+    v[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+static void chunkCVx4(const uchar *data, quint64 counter, quint32 cvs[][8])
+{
+    __m128i h[8], m[16], s[16];
+    __m128i counterLo = _mm_set_epi32(counter + 3, counter + 2, counter + 1, counter);
+    __m128i counterHi = _mm_set_epi32((counter + 3) >> 32, (counter + 2) >> 32,
+                                      (counter + 1) >> 32, counter >> 32);
+
+    for (int i = 0; i < 8; ++i)
+        h[i] = _mm_set1_epi32(blake3IV[i]);
+
+    for (int blk = 0; blk < BLAKE3_CHUNK / BLAKE3_BLOCK; ++blk){
+        quint32 flags = (blk == 0 ? CHUNK_START : 0);
+        if (blk == BLAKE3_CHUNK / BLAKE3_BLOCK - 1)
+            flags |= CHUNK_END;
+
+        for (int q = 0; q < 4; ++q){
+            for (int lane = 0; lane < 4; ++lane)
+                m[4 * q + lane] = _mm_loadu_si128((const __m128i*) (data + lane * BLAKE3_CHUNK + blk * BLAKE3_BLOCK + 16 * q));
+            transpose4(m + 4 * q);
+        }
+
+        for (int i = 0; i < 8; ++i)
+            s[i] = h[i];
+        for (int i = 0; i < 4; ++i)
+            s[i + 8] = _mm_set1_epi32(blake3IV[i]);
+        s[12] = counterLo;
+        s[13] = counterHi;
+        s[14] = _mm_set1_epi32(BLAKE3_BLOCK);
+        s[15] = _mm_set1_epi32(flags);
+
+        #pragma GCC unroll 7
+        for (int r = 0; r < 7; ++r){
+            const int *w = schedule[r];
+            G4(s[0], s[4], s[8], s[12], m[w[0]], m[w[1]]);
+            G4(s[1], s[5], s[9], s[13], m[w[2]], m[w[3]]);
+            G4(s[2], s[6], s[10], s[14], m[w[4]], m[w[5]]);
+            G4(s[3], s[7], s[11], s[15], m[w[6]], m[w[7]]);
+            G4(s[0], s[5], s[10], s[15], m[w[8]], m[w[9]]);
+            G4(s[1], s[6], s[11], s[12], m[w[10]], m[w[11]]);
+            G4(s[2], s[7], s[8], s[13], m[w[12]], m[w[13]]);
+            G4(s[3], s[4], s[9], s[14], m[w[14]], m[w[15]]);
+        }
+
+        for (int i = 0; i < 8; ++i)
+            h[i] = _mm_xor_si128(s[i], s[i + 8]);
+    }
+
+    transpose4(h);
+    transpose4(h + 4);
+    for (int lane = 0; lane < 4; ++lane){
+        _mm_storeu_si128((__m128i*) cvs[lane], h[lane]);
+        _mm_storeu_si128((__m128i*) (cvs[lane] + 4), h[lane + 4]);
+    }
+}
+
+// AVX2 does 16 and 8 bit rotations with a byte shuffle
+#define ROR8X16(x) _mm256_shuffle_epi8(x, rot16)
+#define ROR8X8(x) _mm256_shuffle_epi8(x, rot8)
+#define ROR8(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+#define G8(a, b, c, d, mx, my)                                      \
+    a = _mm256_add_epi32(_mm256_add_epi32(a, b), mx);               \
+    d = ROR8X16(_mm256_xor_si256(d, a));                            \
+    c = _mm256_add_epi32(c, d);                                     \
+    b = ROR8(_mm256_xor_si256(b, c), 12);                           \
+    a = _mm256_add_epi32(_mm256_add_epi32(a, b), my);               \
+    d = ROR8X8(_mm256_xor_si256(d, a));                             \
+    c = _mm256_add_epi32(c, d);                                     \
+    b = ROR8(_mm256_xor_si256(b, c), 7);
+
+__attribute__((target("avx2")))
+static inline void transpose8(__m256i v[8])
+{
+    __m256i t0 = _mm256_unpacklo_epi32(v[0], v[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(v[0], v[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(v[2], v[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(v[2], v[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(v[4], v[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(v[4], v[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(v[6], v[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(v[6], v[7]);
+
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+    v[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    v[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    v[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    v[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    v[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    v[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    v[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    v[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+__attribute__((target("avx2")))
+static void chunkCVx8(const uchar *data, quint64 counter, quint32 cvs[][8])
+{
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+                                          1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    __m256i h[8], m[16], s[16];
+    __m256i counterLo, counterHi;
+    quint32 lo[8], hi[8];
+
+    for (int lane = 0; lane < 8; ++lane){
+        lo[lane] = counter + lane;
+        hi[lane] = (counter + lane) >> 32;
+    }
+    counterLo = _mm256_loadu_si256((const __m256i*) lo);
+    counterHi = _mm256_loadu_si256((const __m256i*) hi);
+
+    for (int i = 0; i < 8; ++i)
+        h[i] = _mm256_set1_epi32(blake3IV[i]);
+
+    for (int blk = 0; blk < BLAKE3_CHUNK / BLAKE3_BLOCK; ++blk){
+        quint32 flags = (blk == 0 ? CHUNK_START : 0);
+        if (blk == BLAKE3_CHUNK / BLAKE3_BLOCK - 1)
+            flags |= CHUNK_END;
+
+        for (int half = 0; half < 2; ++half){
+            for (int lane = 0; lane < 8; ++lane)
+                m[8 * half + lane] = _mm256_loadu_si256((const __m256i*) (data + lane * BLAKE3_CHUNK + blk * BLAKE3_BLOCK + 32 * half));
+            transpose8(m + 8 * half);
+        }
+
+        for (int i = 0; i < 8; ++i)
+            s[i] = h[i];
+        for (int i = 0; i < 4; ++i)
+            s[i + 8] = _mm256_set1_epi32(blake3IV[i]);
+        s[12] = counterLo;
+        s[13] = counterHi;
+        s[14] = _mm256_set1_epi32(BLAKE3_BLOCK);
+        s[15] = _mm256_set1_epi32(flags);
+
+        #pragma GCC unroll 7
+        for (int r = 0; r < 7; ++r){
+            const int *w = schedule[r];
+            G8(s[0], s[4], s[8], s[12], m[w[0]], m[w[1]]);
+            G8(s[1], s[5], s[9], s[13], m[w[2]], m[w[3]]);
+            G8(s[2], s[6], s[10], s[14], m[w[4]], m[w[5]]);
+            G8(s[3], s[7], s[11], s[15], m[w[6]], m[w[7]]);
+            G8(s[0], s[5], s[10], s[15], m[w[8]], m[w[9]]);
+            G8(s[1], s[6], s[11], s[12], m[w[10]], m[w[11]]);
+            G8(s[2], s[7], s[8], s[13], m[w[12]], m[w[13]]);
+            G8(s[3], s[4], s[9], s[14], m[w[14]], m[w[15]]);
+        }
+
+        for (int i = 0; i < 8; ++i)
+            h[i] = _mm256_xor_si256(s[i], s[i + 8]);
+    }
+
+    transpose8(h);
+    for (int lane = 0; lane < 8; ++lane)
+        _mm256_storeu_si256((__m256i*) cvs[lane], h[lane]);
+}
+
+#endif // BLAKE3_X86
+
+typedef void (*ChunksFunction)(const uchar *data, quint64 counter, quint32 cvs[][8]);
+
+struct ChunkKernel
+{
+    ChunksFunction hash;
+    int lanes;
+};
+
+static ChunkKernel pickKernel()
+{
+    ChunkKernel kernel = {0, 1};
+#ifdef BLAKE3_X86
+    kernel.hash = chunkCVx4;
+    kernel.lanes = 4;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        kernel.hash = chunkCVx8;
+        kernel.lanes = 8;
+    }
+#endif
+    return kernel;
+}
+
+static const ChunkKernel kernel = pickKernel();
+
+static void blake3(const uchar *data, qint64 size, uchar *digest)
+{
+    quint32 stack[BLAKE3_MAXDEPTH][8];
+    quint32 cv[8];
+    int depth = 0;
+
+    // A single chunk is the root itself
+    if (size <= BLAKE3_CHUNK){
+        chunkCV(data, size, 0, ROOT, cv);
+    }
+    // Otherwise every chunk but the last is pushed on the CV stack, merging
+    // completed subtrees as it goes. The last chunk is then folded down the
+    // stack, with the ROOT flag on the final parent.
+    else{
+        qint64 nChunks = (size + BLAKE3_CHUNK - 1) / BLAKE3_CHUNK;
+        qint64 nFull = size / BLAKE3_CHUNK;
+        qint64 chunk = 0;
+
+        while (chunk < nChunks){
+            quint32 cvs[8][8];
+            int n = 1;
+            if (kernel.hash && chunk + kernel.lanes <= nFull){
+                kernel.hash(data + chunk * BLAKE3_CHUNK, chunk, cvs);
+                n = kernel.lanes;
+            }
+            else{
+                chunkCV(data + chunk * BLAKE3_CHUNK, qMin((qint64) BLAKE3_CHUNK, size - chunk * BLAKE3_CHUNK), chunk, 0, cvs[0]);
+            }
+
+            for (int i = 0; i < n; ++i){
+                memcpy(cv, cvs[i], sizeof(cv));
+                if (++chunk == nChunks)
+                    break;
+                for (quint64 total = chunk; (total & 1) == 0; total >>= 1)
+                    parentCV(stack[--depth], cv, 0, cv);
+                memcpy(stack[depth++], cv, sizeof(cv));
+            }
+        }
+
+        while (depth > 0){
+            --depth;
+            parentCV(stack[depth], cv, depth == 0 ? ROOT : 0, cv);
+        }
+    }
+
+    for (int i = 0; i < 8; ++i)
+        storeLE32(digest + 4 * i, cv[i]);
+}
+
+QByteArray blake3sum(QByteArray data)
+{
+    return blake3sum(data.constData(), data.size());
+}
+
+QByteArray blake3sum(const char *data, qint64 size)
+{
+    QByteArray digest(BLAKE3_DIGEST_SIZE, Qt::Uninitialized);
+    blake3((const uchar*) data, size, (uchar*) digest.data());
+    return digest;
+}
+
+QList<QByteArray> blake3sumBlocks(const char *data, qint64 size, int blockSize)
+{
+    QList<QByteArray> hashes;
+    for (qint64 pos = 0; pos < size; pos += blockSize)
+        hashes << blake3sum(data + pos, qMin((qint64) blockSize, size - pos));
+    return hashes;
+}
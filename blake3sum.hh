@@ -0,0 +1,15 @@
+#ifndef BLAKE3SUM_HH
+#define BLAKE3SUM_HH
+
+#include <QByteArray>
+#include <QList>
+
+#define BLAKE3_DIGEST_SIZE 32 // bytes
+
+QByteArray blake3sum(QByteArray data);
+QByteArray blake3sum(const char *data, qint64 size);
+
+// Hashes consecutive blockSize blocks of data (the last one may be short)
+QList<QByteArray> blake3sumBlocks(const char *data, qint64 size, int blockSize);
+
+#endif // BLAKE3SUM_HH
@@ -0,0 +1,62 @@
+#include "hashsum.hh"
+#include "sha1sum.hh"
+#include "blake3sum.hh"
+
+int digestSize(quint8 algo)
+{
+    switch (algo){
+        case HASH_SHA1:
+            return SHA1_DIGEST_SIZE;
+        case HASH_BLAKE3:
+            return BLAKE3_DIGEST_SIZE;
+    }
+    return 0;
+}
+
+bool isKnownHash(quint8 algo)
+{
+    return digestSize(algo) > 0;
+}
+
+QString hashName(quint8 algo)
+{
+    switch (algo){
+        case HASH_SHA1:
+            return QString("sha1");
+        case HASH_BLAKE3:
+            return QString("blake3");
+    }
+    return QString("unknown");
+}
+
+int hashFromName(QString name)
+{
+    name = name.toLower();
+    if (name == "sha1")
+        return HASH_SHA1;
+    if (name == "blake3")
+        return HASH_BLAKE3;
+    return -1;
+}
+
+QByteArray hashsum(quint8 algo, const QByteArray &data)
+{
+    switch (algo){
+        case HASH_SHA1:
+            return sha1sum(data);
+        case HASH_BLAKE3:
+            return blake3sum(data);
+    }
+    return QByteArray();
+}
+
+QList<QByteArray> hashsumBlocks(quint8 algo, const char *data, qint64 size, int blockSize)
+{
+    switch (algo){
+        case HASH_SHA1:
+            return sha1sumBlocks(data, size, blockSize);
+        case HASH_BLAKE3:
+            return blake3sumBlocks(data, size, blockSize);
+    }
+    return QList<QByteArray>();
+}
@@ -0,0 +1,31 @@
+#ifndef HASHSUM_HH
+#define HASHSUM_HH
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+// Hash functions a Merkle tree can be built with. Stored per file in the
+// database and announced in search replies, so values must never change.
+enum hashAlgo {
+    HASH_SHA1 = 0,
+    HASH_BLAKE3 = 1
+};
+
+#define HASH_DEFAULT    HASH_SHA1
+#define MAX_DIGEST_SIZE 32  // bytes
+
+// Digest size in bytes, 0 for unknown algorithms
+int digestSize(quint8 algo);
+bool isKnownHash(quint8 algo);
+
+// Names used on the command line ("sha1", "blake3"). -1 for unknown names.
+QString hashName(quint8 algo);
+int hashFromName(QString name);
+
+QByteArray hashsum(quint8 algo, const QByteArray &data);
+
+// Hashes consecutive blockSize blocks of data (the last one may be short)
+QList<QByteArray> hashsumBlocks(quint8 algo, const char *data, qint64 size, int blockSize);
+
+#endif // HASHSUM_HH
@@ -1,56 +1,97 @@
 #include "main.hh"
-#include <QtCrypto>
 
 int main(int argc, char **argv)
-{	
+{
+	// Headless nodes run the engine without any widgets
+	bool headless = false;
+	for (int a = 1; a < argc; ++a){
+		if (QString(argv[a]) == "--headless")
+			headless = true;
+	}
+
 	// Initialize Qt toolkit
-	QApplication app(argc,argv);
-	
+	QCoreApplication *app;
+	if (headless)
+		app = new QCoreApplication(argc, argv);
+	else
+		app = new QApplication(argc, argv);
+
 	qDebug() << "************************************";
-	
+
 	QList<QString> cmdArguments = QCoreApplication::arguments();
 	QList<QString>::iterator i;
-	
+
 	QTime now = QTime::currentTime();
 	qsrand(now.msec());
 
-	// Create an initial chat dialog window
-	ChatDialog dialog;
-	
-	// Crypto initializer
-	QCA::Initializer init;
+	// Create the sharing engine
+	Node node;
 
 	// Create a UDP network socket
 	NetSocket sock;
 	if (!sock.bind())
 		exit(1);
 
-    dialog.setPort(sock.getPort());
-    dialog.initNeighbors(sock.getUDPPorts());
-	
+    node.setPort(sock.getPort());
+    node.initNeighbors(sock.getUDPPorts());
+
     // Add command-line specified neighbors
 	i = cmdArguments.begin();
 	for (i += 1; i != cmdArguments.end(); ++i){
 		if (*i == "-noforward"){
-			dialog.setForwarding(false);
+			node.setForwarding(false);
 			qDebug() << "Forwarding off";
 		}
+		else if (*i == "--headless"){
+			qDebug() << "Running headless";
+		}
+		// Serve files shared from here on in place, without copying them
+		else if (*i == "-inplace"){
+			node.setShareInPlace(true);
+		}
+		// Hash for files shared from here on: sha1 or blake3
+		else if (*i == "-hash" && (i + 1) != cmdArguments.end()){
+			++i;
+			int algo = hashFromName(*i);
+			if (algo < 0)
+				qDebug() << "Unknown hash" << *i << "keeping" << hashName(node.hashAlgo);
+			else
+				node.hashAlgo = algo;
+		}
+		// How many files are hashed at once
+		else if (*i == "-jobs" && (i + 1) != cmdArguments.end()){
+			++i;
+			node.setShareJobs(i->toInt());
+		}
+		// Serve downloads to a media player on this port, see StreamServer
+		else if (*i == "-stream" && (i + 1) != cmdArguments.end()){
+			++i;
+			node.startStreaming(i->toUShort());
+		}
+		// Share a file from the command line (handy for headless seeders)
+		else if (*i == "-share" && (i + 1) != cmdArguments.end()){
+			++i;
+			node.shareFiles(QStringList() << *i);
+		}
 		else
-			dialog.processNewNeigh(*i);
+			node.processNewNeigh(*i);
 	}
 
 	// Send route message on startup to random neighbor
-    dialog.sendStatus();
-	dialog.sendRoute();
-		
-	dialog.show();
-		
-	QObject::connect(&dialog, SIGNAL(outmsgReady(QByteArray*, QHostAddress, int)), &sock, SLOT(broadcastMsg(QByteArray*, QHostAddress, int)));
+    node.sendStatus();
+	node.sendRoute();
+
+	// The GUI is just a front end on top of the node
+	ChatDialog *dialog = NULL;
+	if (!headless){
+		dialog = new ChatDialog(&node);
+		dialog->show();
+	}
+
+	QObject::connect(&node, SIGNAL(outmsgReady(QByteArray, QHostAddress, int)), &sock, SLOT(broadcastMsg(QByteArray, QHostAddress, int)));
 	QObject::connect(&sock, SIGNAL(readyRead()), &sock, SLOT(receiveMsg()));
-    QObject::connect(&sock, SIGNAL(msgReceived(QByteArray*, Peer)), &dialog, SLOT(readNewMsg(QByteArray*, Peer)));
-    QObject::connect(&sock, SIGNAL(gotNewPeer(Peer)), &dialog, SLOT(addIfNewPeer(Peer)));
+    QObject::connect(&sock, SIGNAL(msgReceived(QByteArray, Peer)), &node, SLOT(readNewMsg(QByteArray, Peer)));
 
 	// Enter the Qt main loop; everything else is event driven
-	return app.exec();
+	return app->exec();
 }
-
@@ -13,6 +13,8 @@
 #include <QByteArray>
 #include <QIODevice>
 #include <QUdpSocket>
+#include <QTcpServer>
+#include <QTcpSocket>
 #include <QIcon>
 #include <QHostInfo>
 #include <QList>
@@ -36,50 +38,71 @@
 #include <QHeaderView>
 #include <QGroupBox>
 #include <QProgressBar>
+#include <QCheckBox>
 #include <QBitArray>
 #include <Database.hh>
+#include <Packet.hh>
+#include <BlockQueue.hh>
+#include <DownloadWriter.hh>
+#include <QFutureWatcher>
+#include <hashsum.hh>
 #include <QMutex>
+#include <QElapsedTimer>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QAtomicInt>
+#include <QtConcurrentMap>
 
 #define CEILING(x,y) (((x) + (y) - 1) / (y))
 
 #define STATUS_PERIOD   5000
 #define ROUTE_PERIOD    60000
+#define CHECKPOINT_PERIOD 10000 // msec between download checkpoints
+#define GUI_REFRESH     100     // msec, download rows are redrawn at most this often
 #define MONG_TIMEOUT    1000
 #define TIMEOUT_NEXT    5
 
 #define CHATHOPLIMIT    10
-#define HASHSIZE        20   // bytes
 #define BLOCKSIZE       8192  // bytes
-#define BLOCKTIMEOUT    2000 // msec
-#define HASHESPERBLOCK  CEILING(BLOCKSIZE,HASHSIZE)
+#define BLOCKTIMEOUT    2000 // msec, request timeout until a peer's RTT is measured
+#define RTO_MIN         50      // msec
+#define RTO_MAX         30000   // msec
+#define HASHESPERBLOCK(algo) CEILING(BLOCKSIZE,digestSize(algo))
+
+#define WINDOW_INIT     2       // Requests outstanding per peer at first
+#define WINDOW_MIN      1
+#define WINDOW_MAX      64
+#define WINDOW_SSTHRESH 16      // Slow start ends here until the first loss
+#define SLOW_RATIO      4       // Peers this many times slower than the fastest...
+#define SLOW_WINDOW     2       // ...keep only this many requests out
+#define REQUEST_BATCH   16      // Most hashes in one block request
+#define SUBTREE_DEPTH   2       // Metadata levels asked for along with the head
+
+#define STREAM_URGENT   32      // Blocks from the playhead on that have deadlines
+#define STREAM_DEADLINE 500     // msec an urgent block waits before a second peer is asked
+#define STREAM_TICK     100     // msec between deadline checks
+#define STREAM_BUFFER   (256 * 1024) // Bytes queued on a stream socket at most
+#define QUARANTINE_BAD  2       // Bad blocks after which a peer is not asked anymore
+#define ENDGAME_PENDING 8       // Blocks left in flight when endgame starts
+#define ENDGAME_COPIES  3       // Peers asked at once for a block in endgame
 
 #define FILE_INCOMPLETE 0
 #define FILE_COMPLETE   1
+#define FILE_HASHING    2       // Share job running, see ShareJob
+
+#define SHARE_JOBS      2       // Files hashed at once, by default
+#define SHARE_PROGRESS  250     // msec between progress reports of a share job
 
 #define DB_NOT_FOUND -2
 
-// For message type map at ChatDialog::readNewMsg
-enum keyType {
-    SEQNO = 0,
-    ORIGIN,
-    LASTIP,
-    LASTPORT,
-    WANT,
-    BLOCKREQUEST,
-    DEST,
-    HOPLIMIT,
-    BLOCKREPLY,
-    DATA,
-    SEARCH,
-    BUDGET,
-    SEARCHREPLY,
-    MATCHNAMES,
-    MATCHIDS,
-    MATCHSIZES,
-    ISDATA,
-    INDEX,
-    NKEYTYPES
-};
+#define RECV_BATCH      32      // datagrams per recvmmsg()
+#define MAX_DATAGRAM    65536   // bytes
+#define RECV_BUFFER     (4 * 1024 * 1024) // bytes, kernel socket receive buffer
+#define SEND_BATCH      32      // datagrams per sendmmsg()
+#define SENDQ_MAX       2048    // datagrams queued per destination
+#define PACE_RATE       (16 * 1024 * 1024) // bytes/s per destination, 0 to disable
+#define PACE_BURST      (256 * 1024) // bytes
+#define PACE_INTERVAL   2       // msec, flush period while paced
 
 // For download list layout
 enum columnNames {
@@ -161,12 +184,13 @@ class SharedFile : public QObject
     Q_OBJECT
 
     public:
-        SharedFile(QString, quint64, QByteArray, quint32);
+        SharedFile(QString, quint64, QByteArray, quint32, quint8);
 
          QString name;
          quint64 size;
          QByteArray hashHead; // Main hash of file
          quint32 id;          // Id of file, used by DB
+         quint8 hashAlgo;     // Hash the Merkle tree is built with
 
     private:
 
@@ -177,23 +201,122 @@ class SharedFile : public QObject
     signals:
 };
 
+// A run of consecutive leaf blocks of a file, hashed by one worker thread
+// while building a Merkle tree
+class LeafChunk
+{
+    public:
+        LeafChunk(QString filePath = QString(), qint64 first = 0, int count = 0, quint8 hashAlgo = HASH_DEFAULT, bool keepBlocks = true);
+
+        QString filePath;
+        quint8 hashAlgo;
+        bool keepBlocks;            // False when shared in place
+        qint64 first;               // Index of the first block
+        int count;                  // Number of blocks
+        QList<QByteArray> hashes;   // Filled in by hashLeafChunk()
+        QList<QByteArray> blocks;   // Only if keepBlocks
+};
+
+LeafChunk hashLeafChunk(const LeafChunk &chunk);
+
+// Shares one file in the background: builds its Merkle tree on Node's share
+// pool, writing blocks to the file's pack as it goes. Node records and
+// publishes the file when finished() comes back with ok set.
+class ShareJob : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+    public:
+        ShareJob(Database *db, QString filePath, quint32 fileId, quint8 hashAlgo, bool inPlace);
+
+        QString filePath;
+        QString name;
+        quint64 size;
+        qint64 mtime;           // When the job was created
+        quint32 fileId;
+        quint8 hashAlgo;
+        bool inPlace;
+        QByteArray hashHead;    // Set when done
+        bool ok;                // Done, not canceled and not failed
+
+        void run();
+        void cancel();
+        bool isCanceled();
+
+    private:
+        Database *db;
+        QAtomicInt canceled;
+        qint64 position;        // Leaves hashed so far
+        QElapsedTimer progressClock;
+
+        void fillQ0(QQueue<QByteArray> &q);
+        QByteArray hashQueue(QQueue<QByteArray> &q);
+        QByteArray buildMerkleTree();
+
+    signals:
+        void progress(ShareJob *job, quint64 nBlocks);
+        void finished(ShareJob *job);
+};
+
 class FileDownload;
 
+// Requests a download keeps outstanding with one peer. Grows AIMD style:
+// by one per reply up to the slow start threshold, by one per window of
+// replies after that, and halves on a timeout. Timeouts of requests sent
+// before the last cut don't cut it again.
+// Also estimates the peer's round trip time (Jacobson/Karels), which sets
+// the timeout of requests sent to it. Each timeout doubles it until the
+// next good sample. The rest of the statistics rank peers in employPeers().
+class PeerWindow
+{
+    public:
+        PeerWindow();
+
+        double size;            // Requests allowed in flight
+        double ssthresh;
+        int inFlight;
+        quint32 sent;           // Requests sent so far, numbers them
+        quint32 recover;        // First request sent after the last cut
+
+        // Round trip time, msec
+        double srtt;            // Smoothed, 0 until the first sample
+        double rttvar;
+        int rto;                // Timeout for new requests, backed off
+
+        // Statistics
+        quint64 bytes;          // Good blocks received
+        quint32 losses;         // Timeouts
+        quint32 bad;            // Blocks that didn't match their hash
+        bool quarantined;       // Sent bad data too often, not asked anymore
+        QElapsedTimer active;   // Since the first request
+
+        bool canSend(int limit = WINDOW_MAX) const { return inFlight < qMin((int) size, limit); }
+        int room(int limit = WINDOW_MAX) const { return qMin((int) size, limit) - inFlight; }
+        double rate() const;    // Bytes/s since the first request
+        quint32 onSend();
+        void onReply(int size);
+        void onLoss(quint32 seq);
+        void onCancel();
+        bool onBadBlock();
+        void onRttSample(qint64 rtt);
+};
+
 // Class to store data for specific packet requests
 class BlockRequest : public QObject
 {
     Q_OBJECT
 
     public:
-        BlockRequest(FileDownload* parent, QByteArray hash, QString source, QString priority, quint16 maxClock);
+        BlockRequest(FileDownload* parent, QByteArray hash, QString source, quint64 position, int timeout);
 
         FileDownload *parent;   // Download to which block belongs
         QByteArray hash;        // Hash of block
         QString source;         // Block requested from this source
-        QString priority;       // Priority string
-        quint16 clock;          // Manually ticked on packet receives
-        quint16 maxClock;       // Timeout for clock
-        QTimer timer;           // Time kept timer
+        quint64 position;       // Place in the tree, see BlockQueue
+        quint32 seq;            // Number in the source's PeerWindow
+        bool retry;             // Block was requested before, no RTT sample
+        QElapsedTimer sent;
+        QTimer timer;           // Fires after the source's RTO
 
     public slots:
         void sendTimeout();
@@ -209,7 +332,8 @@ class FileDownload : public QObject
     Q_OBJECT
 
     public:
-        FileDownload(QString fileName, QString path, quint64 size, QByteArray hashHead, QList<QString> peers);
+        FileDownload(QString fileName, QString path, quint64 size, QByteArray hashHead, quint8 hashAlgo,
+                     quint32 fileId, QList<QString> peers);
         ~FileDownload();
 
         // File metadata
@@ -217,88 +341,142 @@ class FileDownload : public QObject
         QString path;
         quint64 size;
         QByteArray hashHead;
+        quint8 hashAlgo;
+        quint32 fileId;                                 // Pack verified blocks are served from
 
-        QMap<QString, QByteArray> blockQ;               // Block priority queue
-        QMap<QByteArray, QString> hashToPriority;
-        QHash<QByteArray, BlockRequest*> pendingReqs;   // Requests pending from peers
+        BlockQueue blockQ;                              // Blocks to request, in pre-order
+        int leafLevel;                                  // Depth of the leaves, -1 until one arrives
+        qint64 playhead;                                // Block a stream is waiting on, -1 if none
+        QMultiHash<QByteArray, BlockRequest*> pendingReqs; // Requests pending from peers, several per block in endgame
         QList<QString> peers;
-        QList<QString> freePeers;
+        QHash<QString, PeerWindow> windows;             // By peer
+        QSet<QByteArray> retried;                       // Blocks that timed out once
+        bool dirty;                                     // Changed since the last checkpoint
+
+        QByteArray savedFileMap() const;
+        QByteArray savedFrontier() const;
+        bool restore(QByteArray savedMap, QByteArray savedFrontier);
         QBitArray fileMap;                              // Bitmap: blocks received so far
-        FileListItem *listItem;
+
+        // Progress, kept up to date block by block
+        quint64 received;                               // Bits set in fileMap
+        quint64 watermark;                              // Blocks below it are all in
+        quint64 receivedAtStart;                        // received when this run began
+        QElapsedTimer started;
+
+        bool markReceived(quint64 idx);
+        void unmarkReceived(quint64 idx);
+        bool isComplete() const { return received == (quint64) fileMap.size(); }
+        double rate() const;                            // Bytes/s in this run
+        qint64 eta() const;                             // Seconds left, -1 if unknown
+
+        // Writing, and checkpoints waiting for their sync
+        DownloadWriter writer;
+        QFutureWatcher<bool> syncWatcher;
+        QByteArray checkpointMap;
+        QByteArray checkpointFrontier;
+
+        // Leaves written but not synced yet, by index. Until they are, they
+        // are only served from the block cache.
+        QList<QPair<quint64, QByteArray> > unsynced;
+        QList<QPair<quint64, QByteArray> > checkpointLeaves;
+
+    private slots:
+        void syncFinished();
+
+    signals:
+        void synced(FileDownload *download);
 };
 
 class SearchDialog;
+class StreamServer;
 
-class ChatDialog : public QDialog
+// The sharing engine: protocol, routing, downloads and Merkle trees. Has no
+// widgets, so it can run on its own under QCoreApplication (see --headless).
+class Node : public QObject
 {
-	Q_OBJECT
+    Q_OBJECT
 
-	public:
-		ChatDialog();
+    public:
+        Node();
+        ~Node();
 
-		QString host;
-		int port;
-		bool forward;
+        QString host;
+        int port;
+        bool forward;
         quint32 myHopLimit;
         QString downloadPath;
+        quint8 hashAlgo;    // Used for newly shared files
+        bool shareInPlace;  // Serve new files from where they are, don't copy them
+        QVariantMap status;
         QMap<QByteArray, FileDownload*> fileDownloads;
+        QMap<quint32, SharedFile*> sharedFiles;
+        QMap<quint32, ShareJob*> shareQueue;    // Files being shared, by id
+        StreamServer *streamServer;             // 0 unless streaming is on
 
         void setPort(int p);
         void setForwarding(bool set);
         void initNeighbors(QList<quint16>* ports);
+        void processNewNeigh(QString input);
+        void deleteSharedFile(quint32 id);
+        void cancelShare(quint32 id);
+        void setShareJobs(int n);
+        bool startStreaming(quint16 port);
+
+        // Streaming
+        void setPlayhead(FileDownload *download, qint64 idx);
+        bool readBlock(FileDownload *download, quint64 idx, QByteArray &data);
 
         // Route table handlers
         void putOnTable(QString origin, Peer pair);
-		void removeFromTable(QString origin);
+        void removeFromTable(QString origin);
         Peer getFromTable(QString origin);
 
-        void printNeighbors();
-
-	public slots:
+    public slots:
         // Message protocol functions
         void rumorTimeout(MongMsg* msg);
-        void readNewMsg(QByteArray* bytes, Peer inpeer);
-		
+        void readNewMsg(QByteArray bytes, Peer inpeer);
+
         // Handling peers/neighbors
-		void newNeighInput();
         void resolveNeighbor(QHostInfo hostInfo);
-        void processNewNeigh(QString input);
         void addIfNewPeer(Peer candidate);
-		
+
         // Packet sending
         void sendStatus(Peer outPeer= Peer());
         void sendRoute(Peer outPeer= Peer());
-        void sendBlockRequest(Peer inPeer, QString dest, QString origin, quint32 hopLimit, QByteArray blockRequest);
-        void sendBlockReply(Peer inPeer, QString dest, QString origin, quint32 hopLimit, QByteArray blockReply, QByteArray blockData, bool isData, quint64 idx);
-        void sendSearchReply(Peer inPeer, QString dest, QString origin, quint32 hopLimit, QString searchReply, QVariantList matchNames, QVariantList matchIds, QVariantList matchSizes);
+        void sendBlockRequest(Peer inPeer, QString dest, QString origin, quint32 hopLimit, QList<QByteArray> blockRequest,
+                              int depth = 0);
+        void sendBlockReply(Peer inPeer, QString dest, QString origin, quint32 hopLimit, QByteArray blockReply, QByteArray blockData, bool isData, quint64 idx,
+                            int following = 0);
+        void sendSearchReply(Peer inPeer, QString dest, QString origin, quint32 hopLimit, QString searchReply, QVariantList matchNames, QVariantList matchIds, QVariantList matchSizes, QVariantList matchAlgos);
         void sendSearchRequest(Peer, QString, QString, quint32);
-        void sendPacket(QVariantMap packet, Peer outPeer);
+        void sendPacket(const Packet &packet, Peer outPeer);
 
         // Downloads and file sharing
-        void showShareFileDialog();
+        void setShareInPlace(bool set);
         void shareFiles(QStringList files);
-        void startFileDownload(QString fileName, quint64 size, QByteArray hashHead, QList<QString> peers);
+        void finishShare(ShareJob *job);
+        void startFileDownload(QString fileName, quint64 size, QByteArray hashHead, quint8 hashAlgo, QList<QString> peers);
         void requestTimeout(BlockRequest *req, FileDownload *download);
-        void loadSharedFromDB(QString filename, quint64 size, QByteArray hashHead, quint32 id);
-        void deleteSelectedFiles();
-
-	private:
-        // GUI
-		QGridLayout *layout;
-		QLineEdit *textNeigh;
-		QListWidget *chatList;
-        QPushButton *shareFileButton;
-        QPushButton *deleteFileButton;
-        QFileDialog *shareFileDialog;
-        SearchDialog *searchDialog;
-        QTableWidget *fileList;
+        void loadSharedFromDB(QString filename, quint64 size, QByteArray hashHead, quint32 id, quint8 hashAlgo);
+        void resumeDownload(QString fileName, QString path, quint64 size, QByteArray hashHead, quint8 hashAlgo,
+                            quint32 fileId, QStringList peers, QByteArray fileMap, QByteArray frontier);
+        void resumeDownloads();
+        void checkpointDownloads(bool wait = false);
+        void saveCheckpoint(FileDownload* download);
+        void serveBlock(QByteArray hash, qint64 idx, QByteArray data);
+        void serveSubtreeBlock(QString origin, QByteArray hash, qint64 idx, QByteArray data, int following);
+        void checkDeadlines();
 
+    private:
         // State
-        QVariantMap status;
-		quint32 msgCounter;	
-		QTimer statusTimer;
-		QTimer routeTimer;
-		
+        quint32 msgCounter;
+        QTimer statusTimer;
+        QTimer routeTimer;
+        QThreadPool shareJobs;
+        QTimer checkpointTimer;
+        QTimer streamTimer;
+
         // Peers
         QList<Peer > neighbors;
         QMap<int, Peer > unresolvedNeighbors;
@@ -307,32 +485,28 @@ class ChatDialog : public QDialog
         // Storage
         Database *db;
         QMap<QString, QMap<quint32, MongMsg*> > msgArchive;
-        QMap<quint32, SharedFile*> sharedFiles;
         QList<MongMsg*> onHold;
         QMap<QByteArray, FileDownload*> hashToFile;
-        QHash<QString, quint8> keyToType;
-		
-        // Initialization functions
-        void initKeyMap();
+        QHash<QByteArray, QStringList> pendingServes; // Origins waiting on a block read
 
         // Status handling
         bool compareStatus(QVariantMap, Peer);
         bool addToStatus(QString, quint32, int isMsg = 0);
-		
+
         // Message sending
-		void broadcastToAll(MongMsg*);
+        void broadcastToAll(MongMsg*);
         void serializeMsg(MongMsg*, Peer outPeer);
-		
+
         Peer randomNeighbor(Peer except1 = Peer(), Peer except2 = Peer());
-		
+
         // Archive handlers
-		MongMsg* getFromArchive(QString, quint32);
+        MongMsg* getFromArchive(QString, quint32);
         void putOnArchive(MongMsg *msg);
-		
-		void monger(MongMsg*);
-		
+
+        void monger(MongMsg*);
+
         // On hold handlers
-		void putOnHold(MongMsg *msg);
+        void putOnHold(MongMsg *msg);
         void removeFromHold(Peer);
         bool isOnHold(Peer);
         MongMsg* getFromHold(Peer);
@@ -340,43 +514,160 @@ class ChatDialog : public QDialog
         // Message type handlers
         void handleRoute(Peer inPeer, bool isNew, bool isDirect, QString origin, quint32 seqNo, QHostAddress lastIP, quint16 lastPort);
         void handleStatus(Peer inPeer, QVariantMap hisStatus);
-        void handleBlockRequest(Peer inPeer, QString dest, QString origin, quint32 hopLimit, QByteArray blockRequest);
-        void handleBlockReply(QString dest, QString origin, quint32 hopLimit, QByteArray blockReply, QByteArray blockData, bool isData, quint64 idx);
+        void handleBlockRequest(Peer inPeer, QString dest, QString origin, quint32 hopLimit, QList<QByteArray> blockRequest, int depth);
+        void replyWithBlock(QString origin, QByteArray hash, qint64 idx, QByteArray data, int following = 0);
+        void handleBlockReply(QString dest, QString origin, quint32 hopLimit, QByteArray blockReply, QByteArray blockData, bool isData, quint64 idx,
+                              int following);
         void handleSearchRequest(Peer inPeer, QString origin, quint32 budget, QString search);
-        void handleSearchReply(Peer inPeer, QString dest, QString origin, quint32 hopLimit, QString searchReply, QVariantList matchNames, QVariantList matchIds, QVariantList sizes);
-
-        // Functions to create shared files
-        void fillQ0(QDataStream&, QQueue<QByteArray>&, qint64 &position);
-        QByteArray hashQueue(QQueue<QByteArray>&);
-        void buildSharedFile(QString filePath);
-        QByteArray buildMerkleTree(QDataStream &in);
-        FileListItem* putOnFileList(int status, QString fileName, quint64 size, quint32 id, int nPeers=0);
+        void handleSearchReply(Peer inPeer, QString dest, QString origin, quint32 hopLimit, QString searchReply, QVariantList matchNames, QVariantList matchIds, QVariantList sizes, QVariantList matchAlgos);
 
         // Functions to control downloads
-        void clockRequests(FileDownload *download);
-        void makeBlockRequest(FileDownload* download, QString dest, QString priority, QByteArray blockHash);
-        void requestNth(QString dest, FileDownload *download, quint32 n);
+        BlockRequest* makeBlockRequest(FileDownload* download, QString dest, quint64 position, QByteArray blockHash,
+                                       QList<QByteArray> *batch = 0);
+        void requestSubtree(FileDownload* download, QString dest, quint64 position, QByteArray blockHash);
+        bool takeNext(FileDownload *download, quint64 &position, QByteArray &hash);
+        void requestUrgent(FileDownload *download);
+        bool isUrgent(FileDownload *download, quint64 position);
+        QString fastestPeer(FileDownload *download, QString except = QString());
+        bool requestNth(QString dest, FileDownload *download, quint32 n);
+        void fillWindow(QString dest, FileDownload *download, int limit = WINDOW_MAX);
+        void quarantinePeer(FileDownload *download, QString peer);
+        void endgame(FileDownload *download);
+        BlockRequest* takeRequest(FileDownload *download, QByteArray hash, QString origin);
         void resolveDownload(FileDownload* download);
-        void updateProgressBar(FileDownload* download, quint64 idx);
-        void writeBlock(FileDownload* download, QByteArray data, quint64 idx);
+        void updateProgress(FileDownload* download, quint64 idx);
+        bool writeBlock(FileDownload* download, QByteArray data, quint64 idx);
+        void dropUnwritten(FileDownload* download, const QList<quint64> &lost);
+        void seedBlock(FileDownload* download, QByteArray hash, QByteArray data, bool isData, quint64 idx);
+        void publishLeaves(FileDownload* download, const QList<QPair<quint64, QByteArray> > &leaves);
+        bool promoteDownload(FileDownload* download);
         void employPeers(FileDownload* download);
-        void enqueueMetadata(FileDownload* download, BlockRequest* req, QByteArray blockData);
+        void enqueueMetadata(FileDownload* download, BlockRequest* req, QByteArray blockData, QString origin, int following);
+        void checkpoint(FileDownload* download, bool wait = false);
+        void commitCheckpoint(FileDownload* download, bool synced);
 
-	signals:
-		void outmsgReady(QByteArray*, QHostAddress, int);
+    signals:
+        void outmsgReady(QByteArray, QHostAddress, int);
+
+        // For front ends
+        void newOrigin(QString origin);
+        void fileShared(SharedFile *sharedFile);
+        void shareStarted(ShareJob *job);
+        void shareProgress(ShareJob *job, quint64 nBlocks);
+        void shareFinished(ShareJob *job);
+        void downloadStarted(FileDownload *download);
+        void downloadProgress(FileDownload *download, quint64 nBlocks);
+        void downloadFinished(FileDownload *download);
+        void searchReplyReceived(QString searchReply, QString origin, QVariantList matchNames, QVariantList matchIds, QVariantList matchSizes, QVariantList matchAlgos);
+};
+
+// One connection to the stream server: a single HTTP request, answered
+// as the blocks it needs come in
+class StreamClient
+{
+    public:
+        StreamClient();
+
+        QByteArray request;     // Received until the header is complete
+        bool responding;
+        FileDownload *download; // 0 once finished, then read from filePath
+        QString filePath;
+        quint64 offset;         // Next byte to send
+        quint64 end;            // One past the last byte to send
+};
+
+// Serves downloads over HTTP on loopback, so a media player can open them
+// while they download: http://127.0.0.1:<port>/<hash head in hex>. Range
+// requests move the download's playhead, see Node::setPlayhead(). Once a
+// download finishes, its URL keeps working until the node exits.
+class StreamServer : public QObject
+{
+    Q_OBJECT
+
+    public:
+        StreamServer(Node *node);
+        bool listen(quint16 port);
+        QString url(FileDownload *download);
+
+    private slots:
+        void newConnection();
+        void readRequest();
+        void sendMore();
+        void dropClient();
+        void downloadProgress(FileDownload *download, quint64 nBlocks);
+        void downloadFinished(FileDownload *download);
+
+    private:
+        Node *node;
+        QTcpServer server;
+        QHash<QTcpSocket*, StreamClient> clients;
+        QHash<QByteArray, QString> finished;    // Paths of downloads finished since startup
+
+        void respond(QTcpSocket *socket, StreamClient &client);
+        void sendBody(QTcpSocket *socket, StreamClient &client);
+        bool readBlock(StreamClient &client, quint64 idx, QByteArray &data);
+        void releasePlayhead(FileDownload *download);
+};
+
+// GUI front end on top of a Node
+class ChatDialog : public QDialog
+{
+	Q_OBJECT
+
+	public:
+		ChatDialog(Node *node);
+
+        Node *node;
+
+	public slots:
+		void newNeighInput();
+        void showShareFileDialog();
+        void deleteSelectedFiles();
+
+        // Node events
+        void addOrigin(QString origin);
+        void addSharedFile(SharedFile *sharedFile);
+        void addShareJob(ShareJob *job);
+        void updateShareProgress(ShareJob *job, quint64 nBlocks);
+        void removeShareJob(ShareJob *job);
+        void addDownload(FileDownload *download);
+        void removeDownload(FileDownload *download);
+        void updateProgressBar(FileDownload* download, quint64 nBlocks);
+        void refreshDownloads();
+        void showSearchReply(QString searchReply, QString origin, QVariantList matchNames, QVariantList matchIds, QVariantList matchSizes, QVariantList matchAlgos);
+
+	private:
+        // GUI
+		QGridLayout *layout;
+		QLineEdit *textNeigh;
+		QListWidget *chatList;
+        QPushButton *shareFileButton;
+        QPushButton *deleteFileButton;
+        QCheckBox *inPlaceBox;
+        QFileDialog *shareFileDialog;
+        SearchDialog *searchDialog;
+        QTableWidget *fileList;
+        QHash<FileDownload*, FileListItem*> downloadItems;
+        QSet<FileDownload*> staleDownloads;     // Rows to redraw on refreshTimer
+        QTimer refreshTimer;
+        QHash<ShareJob*, FileListItem*> shareItems;
+
+        FileListItem* putOnFileList(int status, QString fileName, quint64 size, quint32 id, int nPeers=0);
+        void showPeerStats(FileDownload *download, QTableWidgetItem *statusCell);
 };
 
 // Subclass of table items, for the search tables
 class SearchResult : public QTableWidgetItem
 {
     public:
-        SearchResult(QString fileName, QString peer, QByteArray metaHash, quint64 size);
+        SearchResult(QString fileName, QString peer, QByteArray metaHash, quint64 size, quint8 hashAlgo);
 
         QSet<QString> peers;
         QString fileName;
         QString searchTerm;
         QByteArray metaHash;
         quint64 size;
+        quint8 hashAlgo;
 };
 
 // Search table and search bar/button all part of a group. So, can be
@@ -391,7 +682,7 @@ class SearchDialog : public QGroupBox
         QTableWidget *resultList;
         QString currentSearch;
 
-        void addResult(QString fileName, QString origin, QByteArray hash, quint64 size);
+        void addResult(QString fileName, QString origin, QByteArray hash, quint64 size, quint8 hashAlgo);
 
     public slots:
         void search();
@@ -411,6 +702,17 @@ class SearchDialog : public QGroupBox
         void searchRequested(QString);
 };
 
+// Datagrams waiting to go out to one destination. Paced by a token bucket.
+class SendQueue
+{
+    public:
+        SendQueue(Peer peer, double tokens);
+
+        Peer peer;
+        QQueue<QByteArray> datagrams;
+        double tokens;      // Bytes that may go out right now
+};
+
 // Socket for data transfer accross UDP
 class NetSocket : public QUdpSocket
 {
@@ -418,21 +720,49 @@ class NetSocket : public QUdpSocket
 
 public:
 	NetSocket();
+	~NetSocket();
 
 	// Bind this socket to a Peerster-specific default port.
 	bool bind();
 	int getPort();
 	QList<quint16>* getUDPPorts();
+
+	// Receive statistics
+	quint64 rxPackets;
+	quint64 rxBatches;
+	quint64 rxTruncated;    // Bigger than MAX_DATAGRAM, discarded
+	quint64 rxDropped;      // Dropped by the kernel, receive buffer full
+
+	// Send statistics
+	quint64 txPackets;
+	quint64 txBatches;
+	quint64 txDropped;      // Queue full or unsendable
+	quint32 txQueued;       // Datagrams waiting right now
+	quint32 txMaxQueued;
+
+	double paceRate;        // Bytes/s per destination, 0 for no pacing
 	
 public slots:
-	void broadcastMsg(QByteArray*, QHostAddress, int);
+	void broadcastMsg(QByteArray, QHostAddress, int);
 	void receiveMsg();
+	void flushSendQueue();
 	
 signals:
-    void msgReceived(QByteArray*, Peer);
-    void gotNewPeer(Peer);
+    // The datagram is a view into the receive pool: it is only valid
+    // during the call, so copy whatever has to be kept.
+    void msgReceived(QByteArray, Peer);
 
 private:
 	int myPortMin, myPortMax;
 	int port;
+	char *recvPool;         // RECV_BATCH buffers of MAX_DATAGRAM bytes
+
+	QList<SendQueue*> sendQueues;
+	QTimer flushTimer;
+	QElapsedTimer paceClock;
+	qint64 lastRefill;
+
+	void deliver(char *data, int size, Peer sender);
+	void enqueue(QByteArray msg, Peer dest);
+	int sendBatch(SendQueue **owners, QByteArray *datagrams, int count);
 };
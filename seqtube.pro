@@ -5,24 +5,41 @@
 TEMPLATE =
 TARGET =
 DEPENDPATH += .
-LIBS += -lqca
-INCLUDEPATH += . /usr/include/qca2/QtCrypto
-CONFIG += crypto
+INCLUDEPATH += .
 QT += network sql
-QMAKE_CXXFLAGS += -g -O0
+QMAKE_CXXFLAGS += -g -O2
 
 # Input
 HEADERS += main.hh \
     sha1sum.hh \
-    Database.hh
-SOURCES += main.cc ChatDialog.cc NetSocket.cc TextEdit.cc MongMsg.cc \
+    Database.hh \
+    Packet.hh \
+    hashsum.hh \
+    blake3sum.hh \
+    BlockStore.hh \
+    BlockCache.hh \
+    BlockQueue.hh \
+    DownloadWriter.hh
+SOURCES += main.cc Node.cc ChatDialog.cc NetSocket.cc TextEdit.cc MongMsg.cc \
     BlockRequest.cc \
     SharedFile2.cc \
     Block.cc \
     SearchDialog.cc \
     FileDownload.cc \
     sha1sum.cc \
+    blake3sum.cc \
+    hashsum.cc \
     FileListItem.cc \
-    Database.cc
+    Database.cc \
+    Packet.cc \
+    SendQueue.cc \
+    PeerWindow.cc \
+    LeafChunk.cc \
+    ShareJob.cc \
+    BlockStore.cc \
+    BlockCache.cc \
+    BlockQueue.cc \
+    DownloadWriter.cc \
+    StreamServer.cc
 
 OTHER_FILES +=
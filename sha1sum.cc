@@ -1,16 +1,365 @@
-#include <QByteArray>
-#include <QtCrypto>
+#include "sha1sum.hh"
+#include <QVector>
+#include <string.h>
+
+// SHA-1 in tree. The compression function is picked once at startup: SHA
+// instructions when the CPU has them, portable C otherwise. Without SHA
+// instructions, multi-buffer hashing runs four messages side by side in
+// SSE2 lanes instead.
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SHA1_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define SHA1_BLOCK 64   // bytes
+
+static const quint32 sha1IV[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+typedef void (*CompressFunction)(quint32 state[5], const uchar *data, qint64 nBlocks);
+
+static inline quint32 rol(quint32 x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static inline quint32 loadBE32(const uchar *p)
+{
+    return ((quint32) p[0] << 24) | ((quint32) p[1] << 16) | ((quint32) p[2] << 8) | p[3];
+}
+
+static inline void storeBE32(uchar *p, quint32 v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// Pads the last partial block of a message into tail. Returns the number of
+// blocks in tail (1 or 2).
+static int padTail(const uchar *rest, int restSize, qint64 totalSize, uchar *tail)
+{
+    int nBlocks = (restSize + 9 > SHA1_BLOCK) ? 2 : 1;
+    quint64 bits = (quint64) totalSize * 8;
+
+    memset(tail, 0, nBlocks * SHA1_BLOCK);
+    memcpy(tail, rest, restSize);
+    tail[restSize] = 0x80;
+    storeBE32(tail + nBlocks * SHA1_BLOCK - 8, bits >> 32);
+    storeBE32(tail + nBlocks * SHA1_BLOCK - 4, bits);
+    return nBlocks;
+}
+
+static void compressPortable(quint32 state[5], const uchar *data, qint64 nBlocks)
+{
+    quint32 w[16];
+
+    for (qint64 blk = 0; blk < nBlocks; ++blk, data += SHA1_BLOCK){
+        quint32 a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+        for (int t = 0; t < 80; ++t){
+            quint32 f, k;
+            if (t < 16)
+                w[t] = loadBE32(data + 4 * t);
+            else
+                w[t & 15] = rol(w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15], 1);
+
+            if (t < 20){
+                f = d ^ (b & (c ^ d));
+                k = 0x5A827999;
+            }
+            else if (t < 40){
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if (t < 60){
+                f = (b & c) | (d & (b | c));
+                k = 0x8F1BBCDC;
+            }
+            else{
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+
+            quint32 temp = rol(a, 5) + f + e + k + w[t & 15];
+            e = d;
+            d = c;
+            c = rol(b, 30);
+            b = a;
+            a = temp;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+}
+
+#ifdef SHA1_X86
+
+// Four rounds, once the message schedule is running
+#define SHANI_ROUNDS(E_IN, E_OUT, M0, M1, M2, M3, F)     \
+    E_IN = _mm_sha1nexte_epu32(E_IN, M0);               \
+    E_OUT = abcd;                                       \
+    M1 = _mm_sha1msg2_epu32(M1, M0);                    \
+    abcd = _mm_sha1rnds4_epu32(abcd, E_IN, F);          \
+    M3 = _mm_sha1msg1_epu32(M3, M0);                    \
+    M2 = _mm_xor_si128(M2, M0);
+
+__attribute__((target("sha,sse4.1")))
+static void compressShaNi(quint32 state[5], const uchar *data, qint64 nBlocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcdSave, e0, e0Save, e1;
+    __m128i msg0, msg1, msg2, msg3;
+
+    abcd = _mm_loadu_si128((const __m128i*) state);
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    for (qint64 blk = 0; blk < nBlocks; ++blk, data += SHA1_BLOCK){
+        abcdSave = abcd;
+        e0Save = e0;
+
+        // Rounds 0-15 load the message
+        msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 0)), mask);
+        e0 = _mm_add_epi32(e0, msg0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 16)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+        msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 32)), mask);
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+
+        msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 48)), mask);
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+        msg1 = _mm_xor_si128(msg1, msg3);
+
+        // Rounds 16-67
+        SHANI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 0);
+        SHANI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 1);
+        SHANI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 1);
+        SHANI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 1);
+        SHANI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 1);
+        SHANI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 1);
+        SHANI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 2);
+        SHANI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 2);
+        SHANI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 2);
+        SHANI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 2);
+        SHANI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 2);
+        SHANI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 3);
+        SHANI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 3);
+
+        // Rounds 68-79 wind the schedule down
+        e1 = _mm_sha1nexte_epu32(e1, msg1);
+        e0 = abcd;
+        msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        msg3 = _mm_xor_si128(msg3, msg1);
+
+        e0 = _mm_sha1nexte_epu32(e0, msg2);
+        e1 = abcd;
+        msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+        e1 = _mm_sha1nexte_epu32(e1, msg3);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0Save);
+        abcd = _mm_add_epi32(abcd, abcdSave);
+    }
+
+    abcd = _mm_shuffle_epi32(abcd, 0x1B);
+    _mm_storeu_si128((__m128i*) state, abcd);
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+#define ROL4(x, n) _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+
+// One block of four independent messages, one per 32-bit lane
+static void compressX4(__m128i h[5], const uchar * const blocks[4])
+{
+    __m128i w[16];
+    __m128i a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+    for (int t = 0; t < 80; ++t){
+        __m128i f, k;
+        if (t < 16)
+            w[t] = _mm_set_epi32(loadBE32(blocks[3] + 4 * t), loadBE32(blocks[2] + 4 * t),
+                                 loadBE32(blocks[1] + 4 * t), loadBE32(blocks[0] + 4 * t));
+        else
+            w[t & 15] = ROL4(_mm_xor_si128(_mm_xor_si128(w[(t - 3) & 15], w[(t - 8) & 15]),
+                                           _mm_xor_si128(w[(t - 14) & 15], w[t & 15])), 1);
+
+        if (t < 20){
+            f = _mm_xor_si128(d, _mm_and_si128(b, _mm_xor_si128(c, d)));
+            k = _mm_set1_epi32(0x5A827999);
+        }
+        else if (t < 40){
+            f = _mm_xor_si128(_mm_xor_si128(b, c), d);
+            k = _mm_set1_epi32(0x6ED9EBA1);
+        }
+        else if (t < 60){
+            f = _mm_or_si128(_mm_and_si128(b, c), _mm_and_si128(d, _mm_or_si128(b, c)));
+            k = _mm_set1_epi32(0x8F1BBCDC);
+        }
+        else{
+            f = _mm_xor_si128(_mm_xor_si128(b, c), d);
+            k = _mm_set1_epi32(0xCA62C1D6);
+        }
+
+        __m128i temp = _mm_add_epi32(_mm_add_epi32(ROL4(a, 5), f),
+                                     _mm_add_epi32(_mm_add_epi32(e, k), w[t & 15]));
+        e = d;
+        d = c;
+        c = ROL4(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    h[0] = _mm_add_epi32(h[0], a);
+    h[1] = _mm_add_epi32(h[1], b);
+    h[2] = _mm_add_epi32(h[2], c);
+    h[3] = _mm_add_epi32(h[3], d);
+    h[4] = _mm_add_epi32(h[4], e);
+}
+
+// Hashes four messages of the same size
+static void sha1x4(const char * const *data, qint64 size, char *digests)
+{
+    __m128i h[5];
+    const uchar *blocks[4];
+    uchar tails[4][2 * SHA1_BLOCK];
+    qint64 nFull = size / SHA1_BLOCK;
+    int nTail = 0;
+
+    for (int k = 0; k < 5; ++k)
+        h[k] = _mm_set1_epi32(sha1IV[k]);
+
+    for (qint64 blk = 0; blk < nFull; ++blk){
+        for (int lane = 0; lane < 4; ++lane)
+            blocks[lane] = (const uchar*) data[lane] + blk * SHA1_BLOCK;
+        compressX4(h, blocks);
+    }
+
+    for (int lane = 0; lane < 4; ++lane)
+        nTail = padTail((const uchar*) data[lane] + nFull * SHA1_BLOCK, size % SHA1_BLOCK, size, tails[lane]);
+    for (int blk = 0; blk < nTail; ++blk){
+        for (int lane = 0; lane < 4; ++lane)
+            blocks[lane] = tails[lane] + blk * SHA1_BLOCK;
+        compressX4(h, blocks);
+    }
+
+    for (int k = 0; k < 5; ++k){
+        quint32 lanes[4];
+        _mm_storeu_si128((__m128i*) lanes, h[k]);
+        for (int lane = 0; lane < 4; ++lane)
+            storeBE32((uchar*) digests + lane * SHA1_DIGEST_SIZE + 4 * k, lanes[lane]);
+    }
+}
+
+#endif // SHA1_X86
+
+static CompressFunction pickCompress()
+{
+#ifdef SHA1_X86
+    unsigned int eax, ebx, ecx, edx;
+    bool sha = false, sse41 = false;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        sha = ebx & (1 << 29);
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        sse41 = ecx & (1 << 19);
+    if (sha && sse41)
+        return compressShaNi;
+#endif
+    return compressPortable;
+}
+
+static const CompressFunction compress = pickCompress();
+
+static void sha1(const uchar *data, qint64 size, uchar *digest)
+{
+    quint32 state[5];
+    uchar tail[2 * SHA1_BLOCK];
+    qint64 nFull = size / SHA1_BLOCK;
+
+    memcpy(state, sha1IV, sizeof(state));
+    compress(state, data, nFull);
+    compress(state, tail, padTail(data + nFull * SHA1_BLOCK, size % SHA1_BLOCK, size, tail));
+
+    for (int i = 0; i < 5; ++i)
+        storeBE32(digest + 4 * i, state[i]);
+}
 
 QByteArray sha1sum(QByteArray data)
 {
-    QCA::Hash hashObj("sha1");
-    hashObj.update(data);
-    return hashObj.final().toByteArray();
+    QByteArray digest(SHA1_DIGEST_SIZE, Qt::Uninitialized);
+    sha1((const uchar*) data.constData(), data.size(), (uchar*) digest.data());
+    return digest;
 }
 
 QByteArray sha1sum(char *data, int size)
 {
-    QCA::Hash hashObj("sha1");
-    hashObj.update(data, size);
-    return hashObj.final().toByteArray();
+    QByteArray digest(SHA1_DIGEST_SIZE, Qt::Uninitialized);
+    sha1((const uchar*) data, size, (uchar*) digest.data());
+    return digest;
+}
+
+void sha1sumMany(const char * const *data, const int *sizes, int count, char *digests)
+{
+    int i = 0;
+#ifdef SHA1_X86
+    // SHA instructions beat four SSE2 lanes, only use lanes without them
+    if (compress == compressPortable){
+        while (i + 4 <= count){
+            if (sizes[i + 1] == sizes[i] && sizes[i + 2] == sizes[i] && sizes[i + 3] == sizes[i]){
+                sha1x4(data + i, sizes[i], digests + i * SHA1_DIGEST_SIZE);
+                i += 4;
+            }
+            else{
+                sha1((const uchar*) data[i], sizes[i], (uchar*) digests + i * SHA1_DIGEST_SIZE);
+                i++;
+            }
+        }
+    }
+#endif
+    for (; i < count; ++i)
+        sha1((const uchar*) data[i], sizes[i], (uchar*) digests + i * SHA1_DIGEST_SIZE);
+}
+
+QList<QByteArray> sha1sumBlocks(const char *data, qint64 size, int blockSize)
+{
+    QList<QByteArray> hashes;
+    int count = (size + blockSize - 1) / blockSize;
+    QVector<const char*> blocks(count);
+    QVector<int> sizes(count);
+    QByteArray digests(count * SHA1_DIGEST_SIZE, Qt::Uninitialized);
+
+    for (int i = 0; i < count; ++i){
+        blocks[i] = data + (qint64) i * blockSize;
+        sizes[i] = qMin((qint64) blockSize, size - (qint64) i * blockSize);
+    }
+    sha1sumMany(blocks.constData(), sizes.constData(), count, digests.data());
+
+    for (int i = 0; i < count; ++i)
+        hashes << digests.mid(i * SHA1_DIGEST_SIZE, SHA1_DIGEST_SIZE);
+    return hashes;
 }
@@ -1,7 +1,18 @@
 #ifndef SHA1SUM_HH
 #define SHA1SUM_HH
 
+#include <QByteArray>
+#include <QList>
+
+#define SHA1_DIGEST_SIZE 20 // bytes
+
 QByteArray sha1sum(QByteArray data);
 QByteArray sha1sum(char *data, int size);
 
+// Multi-buffer hashing. Digests are written back to back, count * 20 bytes.
+void sha1sumMany(const char * const *data, const int *sizes, int count, char *digests);
+
+// Hashes consecutive blockSize blocks of data (the last one may be short)
+QList<QByteArray> sha1sumBlocks(const char *data, qint64 size, int blockSize);
+
 #endif // SHA1SUM_HH